@@ -1,165 +1,600 @@
 #include "cache.h"
+#include "shared_mem.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
-//remember we are using LRU cache (least recently used) so 
-//prev is the newest and next is the oldest!!!
+//the cache is split in CACHE_SHARDS shards, each one is a small cache with its own rwlock.
+//recency is approximate (CLOCK): a hit only sets the referenced bit under the read lock,
+//and when a shard is full the hand goes around the ring giving referenced entries a
+//second chance and evicting the first one that wasnt used since the last pass.
+//new entries go right behind the hand so they are the last ones it looks at
 
 //helper functions
-// 1- Remove tail entry from cache
-static void cache_remove_tail(file_cache_t* cache) {
-    if (!cache->tail){
+// 0- FNV-1a hash of the path, with a final mix because the shard comes from the high bits
+//    and FNV leaves them poorly mixed for short paths
+unsigned long cache_hash(const char* path) {
+    unsigned long h = 14695981039346656037UL;
+    while (*path) {
+        h ^= (unsigned char)*path++;
+        h *= 1099511628211UL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    return h;
+}
+
+// the low bits pick the bucket so the shard uses the high bits
+int cache_shard_index(unsigned long hash) {
+    return (int)((hash >> 32) & (CACHE_SHARDS - 1));
+}
+
+static cache_shard_t* cache_shard(file_cache_t* cache, unsigned long hash) {
+    return &cache->shards[cache_shard_index(hash)];
+}
+
+// 1- Free entry memory (only when nobody references it anymore)
+static void cache_free_entry(cache_entry_t* entry) {
+    free(entry->path);
+    free(entry->data);
+    free(entry->gzip);
+    free(entry->headers);
+    free(entry);
+}
+
+// 2- Find entry in the index (any lock must be held)
+static cache_entry_t* cache_lookup(cache_shard_t* shard, const char* path, unsigned long hash) {
+    cache_entry_t* cur = shard->buckets[hash & (shard->nbuckets - 1)];
+    while (cur) {
+        if (cur->hash == hash && strcmp(cur->path, path) == 0) return cur;
+        cur = cur->hnext;
+    }
+    return NULL;
+}
+
+// 3- Double the buckets when the chains start getting long (write lock must be held)
+static void cache_grow_index(cache_shard_t* shard) {
+    size_t nb = shard->nbuckets * 2;
+    cache_entry_t** buckets = calloc(nb, sizeof(cache_entry_t*));
+    if (!buckets) return; // keep working with longer chains
+    for (size_t i = 0; i < shard->nbuckets; i++) {
+        cache_entry_t* cur = shard->buckets[i];
+        while (cur) {
+            cache_entry_t* next = cur->hnext;
+            cur->hnext = buckets[cur->hash & (nb - 1)];
+            buckets[cur->hash & (nb - 1)] = cur;
+            cur = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nb;
+}
+
+// 4- Unlink entry from the ring and the index (write lock must be held)
+static void cache_unlink(cache_shard_t* shard, cache_entry_t* entry) {
+    if (entry->next == entry) { // was only entry
+        shard->hand = NULL;
+    } else {
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        if (shard->hand == entry) shard->hand = entry->next;
+    }
+    entry->prev = entry->next = NULL;
+
+    cache_entry_t** pp = &shard->buckets[entry->hash & (shard->nbuckets - 1)];
+    while (*pp && *pp != entry) pp = &(*pp)->hnext;
+    if (*pp) *pp = entry->hnext;
+    entry->hnext = NULL;
+
+    entry->linked = 0;
+    shard->count--;
+    shard->total_size -= entry->size + entry->gzip_size + entry->headers_len;
+}
+
+// 5- Advance the hand until it finds an entry that wasnt used since last pass and evict it
+static void cache_evict_one(cache_shard_t* shard) {
+    if (!shard->hand){
         fprintf(stderr, "[CACHE] Evicting entry: cache is empty\n");
         return;
     }
+    // at most one full turn clearing bits, the second turn always finds a victim
+    for (;;) {
+        cache_entry_t* cur = shard->hand;
+        if (atomic_exchange_explicit(&cur->referenced, 0, memory_order_relaxed)) {
+            shard->hand = cur->next; // second chance
+            continue;
+        }
+        cache_unlink(shard, cur);
+        // drop the cache reference, if a thread is still sending it the last cache_release frees it
+        cache_release(cur);
+        return;
+    }
+}
+
 
-    cache_entry_t* old = cache->tail;
-    // Remove from list
-    if (old->prev)
-        old->prev->next = NULL;
-    else //was only entry
-        cache->head = NULL;
+// ---- shared mode (one cache in a shared memory segment for all the workers) ----
+//same CLOCK idea but everything is an offset or slot index because it lives in the segment.
+//chunks come from per size class free lists, a class gets a whole slab when its list is empty
+//and when there are no slabs left the hand evicts an entry of the same class.
+//entries that a sender has pinned (refcount > 1) are never evicted, a replaced one is taken out
+//of the index and marked dead and the hand frees it once nobody is sending it anymore
 
-    cache->tail = old->prev;
-    // Subtract from total
-    cache->total_size -= old->size;
-    free(old->path);
-    free(old->data);
-    free(old);
+static shm_cache_slot_t* shm_slot(shm_cache_t* shm, uint32_t i) {
+    return (shm_cache_slot_t*)((char*)shm + shm->slots_off) + i;
 }
 
-// 2- Move entry to front
-static void cache_set_head(file_cache_t* cache, cache_entry_t* entry) {
-    if (cache->head == entry) {
-        fprintf(stderr, "[CACHE] Promoting entry: already at head\n");
-        return;
+static uint32_t* shm_buckets(shm_cache_t* shm) {
+    return (uint32_t*)((char*)shm + shm->buckets_off);
+}
+
+// smallest class that fits size, -1 if bigger than a slab
+static int shm_size_class(size_t size) {
+    size_t chunk = SHM_CACHE_MIN_CHUNK;
+    for (int c = 0; c < SHM_CACHE_CLASSES; c++, chunk <<= 1) {
+        if (size <= chunk) return c;
+    }
+    return -1;
+}
+
+static size_t shm_class_size(int cls) {
+    return (size_t)SHM_CACHE_MIN_CHUNK << cls;
+}
+
+// any lock must be held
+static uint32_t shm_lookup(shm_cache_t* shm, const char* path, unsigned long hash) {
+    uint32_t i = shm_buckets(shm)[hash & (shm->nbuckets - 1)];
+    while (i != SHM_NIL) {
+        shm_cache_slot_t* s = shm_slot(shm, i);
+        if (s->entry.hash == hash && strcmp(s->key, path) == 0) return i;
+        i = s->hnext;
+    }
+    return SHM_NIL;
+}
+
+// take slot out of the index so no new reader finds it (write lock must be held)
+static void shm_unindex(shm_cache_t* shm, uint32_t idx) {
+    shm_cache_slot_t* s = shm_slot(shm, idx);
+    uint32_t* pp = &shm_buckets(shm)[s->entry.hash & (shm->nbuckets - 1)];
+    while (*pp != SHM_NIL && *pp != idx) pp = &shm_slot(shm, *pp)->hnext;
+    if (*pp == idx) *pp = s->hnext;
+    s->hnext = SHM_NIL;
+    s->entry.linked = 0;
+}
+
+// take slot out of the ring and give its chunk and the slot back (write lock must be held)
+static void shm_free_slot(shm_cache_t* shm, uint32_t idx) {
+    shm_cache_slot_t* s = shm_slot(shm, idx);
+    if (s->entry.linked) shm_unindex(shm, idx);
+
+    if (s->next == idx) {
+        shm->hand = SHM_NIL;
+    } else {
+        shm_slot(shm, s->prev)->next = s->next;
+        shm_slot(shm, s->next)->prev = s->prev;
+        if (shm->hand == idx) shm->hand = s->next;
+    }
+    shm->count--;
+    shm->total_size -= shm_class_size(s->size_class);
+
+    // chunk goes back to its class, the first 8 bytes hold the next free chunk
+    *(uint64_t*)((char*)shm + s->chunk_off) = shm->free_chunks[s->size_class];
+    shm->free_chunks[s->size_class] = s->chunk_off;
+
+    s->hnext = shm->free_slots;
+    shm->free_slots = idx;
+}
+
+// advance the hand and free one entry of class cls (-1 = any class), 0 if nothing could be freed
+static int shm_evict(shm_cache_t* shm, int cls) {
+    // two turns is enough to clear every bit and come back to the first candidate
+    size_t steps = 2 * shm->count + 1;
+    while (steps-- > 0 && shm->hand != SHM_NIL) {
+        uint32_t idx = shm->hand;
+        shm_cache_slot_t* s = shm_slot(shm, idx);
+        shm->hand = s->next;
+        if (atomic_load_explicit(&s->entry.refcount, memory_order_acquire) > 1) continue; // pinned
+        if (!s->dead && atomic_exchange_explicit(&s->entry.referenced, 0, memory_order_relaxed)) continue;
+        int matches = (cls < 0 || (int)s->size_class == cls);
+        if (!matches && !s->dead) continue;
+        shm_free_slot(shm, idx); // dead ones are always worth freeing
+        if (matches) return 1;
+    }
+    return 0;
+}
+
+// get a chunk of class cls, 0 if the cache is full of pinned/other class entries
+static uint64_t shm_alloc_chunk(shm_cache_t* shm, int cls) {
+    for (;;) {
+        uint64_t off = shm->free_chunks[cls];
+        if (off) {
+            shm->free_chunks[cls] = *(uint64_t*)((char*)shm + off);
+            return off;
+        }
+        if (shm->next_slab < shm->nslabs) { // carve a new slab for this class
+            uint64_t slab = shm->data_off + (uint64_t)shm->next_slab++ * SHM_CACHE_SLAB_SIZE;
+            size_t chunk = shm_class_size(cls);
+            for (size_t o = SHM_CACHE_SLAB_SIZE; o >= chunk; o -= chunk) {
+                *(uint64_t*)((char*)shm + slab + o - chunk) = shm->free_chunks[cls];
+                shm->free_chunks[cls] = slab + o - chunk;
+            }
+            continue;
+        }
+        if (!shm_evict(shm, cls)) return 0;
+    }
+}
+
+static uint32_t shm_alloc_slot(shm_cache_t* shm) {
+    if (shm->free_slots == SHM_NIL && !shm_evict(shm, -1)) return SHM_NIL;
+    uint32_t idx = shm->free_slots;
+    shm->free_slots = shm_slot(shm, idx)->hnext;
+    return idx;
+}
+
+static cache_entry_t* shm_cache_get(shm_cache_t* shm, const char* path, unsigned long hash) {
+    cache_entry_t* result = NULL;
+    pthread_rwlock_rdlock(&shm->rwlock);
+    uint32_t idx = shm_lookup(shm, path, hash);
+    if (idx != SHM_NIL) {
+        result = &shm_slot(shm, idx)->entry;
+        atomic_fetch_add_explicit(&result->refcount, 1, memory_order_relaxed);
+        if (!atomic_load_explicit(&result->referenced, memory_order_relaxed))
+            atomic_store_explicit(&result->referenced, 1, memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&shm->rwlock);
+    return result;
+}
+
+static cache_entry_t* shm_cache_put(shm_cache_t* shm, const char* path, unsigned long hash,
+                                    unsigned char* data, size_t size, const file_validators_t* validators,
+                                    unsigned char* gzip, size_t gzip_size, cache_render_fn render,
+                                    unsigned long generation) {
+    // rendered from a copy of what the entry will hold, before the chunk size is known
+    char headers[CACHE_HEADERS_MAX];
+    size_t headers_len = 0;
+    if (render) {
+        cache_entry_t tmp;
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.path = (char*)path;
+        tmp.data = data;
+        tmp.size = size;
+        tmp.gzip = gzip;
+        tmp.gzip_size = gzip_size;
+        if (validators) tmp.validators = *validators;
+        headers_len = render(&tmp, headers, sizeof(headers));
+    }
+    // the gzip variant and the headers go in the same chunk, right after the data
+    int cls = shm_size_class(size + gzip_size + headers_len);
+    if (cls < 0 || strlen(path) >= SHM_CACHE_KEY_MAX) return NULL;
+
+    // reserve chunk and slot, the copy is done without the lock
+    pthread_rwlock_wrlock(&shm->rwlock);
+    uint64_t chunk = shm_alloc_chunk(shm, cls);
+    uint32_t idx = chunk ? shm_alloc_slot(shm) : SHM_NIL;
+    if (idx == SHM_NIL) {
+        if (chunk) {
+            *(uint64_t*)((char*)shm + chunk) = shm->free_chunks[cls];
+            shm->free_chunks[cls] = chunk;
+        }
+        pthread_rwlock_unlock(&shm->rwlock);
+        return NULL;
+    }
+    pthread_rwlock_unlock(&shm->rwlock);
+
+    shm_cache_slot_t* s = shm_slot(shm, idx);
+    memcpy((char*)shm + chunk, data, size);
+    if (gzip) memcpy((char*)shm + chunk + size, gzip, gzip_size);
+    if (headers_len) memcpy((char*)shm + chunk + size + gzip_size, headers, headers_len);
+    strcpy(s->key, path);
+    s->chunk_off = chunk;
+    s->size_class = cls;
+    s->dead = 0;
+    s->entry.path = s->key;
+    s->entry.data = (unsigned char*)shm + chunk;
+    s->entry.size = size;
+    s->entry.gzip = gzip ? s->entry.data + size : NULL;
+    s->entry.gzip_size = gzip ? gzip_size : 0;
+    s->entry.headers = headers_len ? (char*)s->entry.data + size + gzip_size : NULL;
+    s->entry.headers_len = headers_len;
+    if (validators) s->entry.validators = *validators;
+    else memset(&s->entry.validators, 0, sizeof(s->entry.validators));
+    s->entry.hash = hash;
+    atomic_store_explicit(&s->entry.refcount, 2, memory_order_relaxed); // cache + caller
+    atomic_store_explicit(&s->entry.referenced, 0, memory_order_relaxed);
+
+    pthread_rwlock_wrlock(&shm->rwlock);
+    if (atomic_load_explicit(&shm->generation, memory_order_relaxed) != generation) {
+        // invalidated while it was being read, give the chunk and the slot back
+        *(uint64_t*)((char*)shm + chunk) = shm->free_chunks[cls];
+        shm->free_chunks[cls] = chunk;
+        s->hnext = shm->free_slots;
+        shm->free_slots = idx;
+        pthread_rwlock_unlock(&shm->rwlock);
+        return NULL;
+    }
+    // another worker may have cached the same file meanwhile, the newest one wins
+    uint32_t old = shm_lookup(shm, path, hash);
+    if (old != SHM_NIL) {
+        if (atomic_load_explicit(&shm_slot(shm, old)->entry.refcount, memory_order_acquire) > 1) {
+            shm_unindex(shm, old);
+            shm_slot(shm, old)->dead = 1;
+        } else {
+            shm_free_slot(shm, old);
+        }
+    }
+
+    uint32_t* bucket = &shm_buckets(shm)[hash & (shm->nbuckets - 1)];
+    s->hnext = *bucket;
+    *bucket = idx;
+    s->entry.linked = 1;
+
+    if (shm->hand == SHM_NIL) { // insert right behind the hand
+        s->prev = s->next = idx;
+        shm->hand = idx;
+    } else {
+        shm_cache_slot_t* h = shm_slot(shm, shm->hand);
+        s->next = shm->hand;
+        s->prev = h->prev;
+        shm_slot(shm, h->prev)->next = idx;
+        h->prev = idx;
+    }
+    shm->count++;
+    shm->total_size += shm_class_size(cls);
+    pthread_rwlock_unlock(&shm->rwlock);
+
+    free(data); // we kept a copy in the segment
+    free(gzip);
+    return &s->entry;
+}
+
+// out of the index for good: freed now, or by the hand once the last sender released it (write lock held)
+static void shm_drop(shm_cache_t* shm, uint32_t idx) {
+    if (atomic_load_explicit(&shm_slot(shm, idx)->entry.refcount, memory_order_acquire) > 1) {
+        shm_unindex(shm, idx);
+        shm_slot(shm, idx)->dead = 1;
+    } else {
+        shm_free_slot(shm, idx);
+    }
+}
+
+static int shm_cache_invalidate(shm_cache_t* shm, const char* path, unsigned long hash) {
+    pthread_rwlock_wrlock(&shm->rwlock);
+    atomic_fetch_add_explicit(&shm->generation, 1, memory_order_relaxed);
+    uint32_t idx = shm_lookup(shm, path, hash);
+    if (idx != SHM_NIL) shm_drop(shm, idx);
+    pthread_rwlock_unlock(&shm->rwlock);
+    return idx != SHM_NIL;
+}
+
+static void shm_cache_invalidate_all(shm_cache_t* shm) {
+    pthread_rwlock_wrlock(&shm->rwlock);
+    atomic_fetch_add_explicit(&shm->generation, 1, memory_order_relaxed);
+    uint32_t* buckets = shm_buckets(shm);
+    for (size_t b = 0; b < shm->nbuckets; b++) {
+        while (buckets[b] != SHM_NIL) shm_drop(shm, buckets[b]); // both take it off the chain
     }
-    // Remove from current position
-    if (entry->prev) entry->prev->next = entry->next;  
-    if (entry->next) entry->next->prev = entry->prev;
-    if (cache->tail == entry && entry->prev)
-        cache->tail = entry->prev;
-    // Insert at front
-    entry->next = cache->head;
-    if (cache->head) cache->head->prev = entry;
-    entry->prev = NULL;
-    cache->head = entry;
-    if (!cache->tail) cache->tail = entry;
+    pthread_rwlock_unlock(&shm->rwlock);
 }
 
 // Create cache
 file_cache_t* cache_create(size_t max_size) {
-    file_cache_t* cache = calloc(1, sizeof(file_cache_t));
+    // shards are cache line aligned so the cache must be too
+    size_t bytes = (sizeof(file_cache_t) + 63) & ~(size_t)63;
+    file_cache_t* cache = aligned_alloc(64, bytes);
     if (!cache){
         perror("Couldnt malloc cache");
         return NULL;
     }
+    memset(cache, 0, bytes);
     cache->max_size = max_size;
-    pthread_rwlock_init(&cache->rwlock, NULL); // Initialize rwlock thread safeee
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        shard->buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(cache_entry_t*));
+        if (!shard->buckets) {
+            perror("Couldnt malloc cache index");
+            while (i-- > 0) {
+                pthread_rwlock_destroy(&cache->shards[i].rwlock);
+                free(cache->shards[i].buckets);
+            }
+            free(cache);
+            return NULL;
+        }
+        shard->nbuckets = CACHE_INITIAL_BUCKETS;
+        shard->max_size = max_size / CACHE_SHARDS;
+        pthread_rwlock_init(&shard->rwlock, NULL); // Initialize rwlock thread safeee
+    }
     return cache;
 }
 
-// Destroy cache
-void cache_destroy(file_cache_t* cache) {
-    cache_entry_t* cur = cache->head;
-    while (cur) { //looping thru all entries and freeing them
-        cache_entry_t* next = cur->next;
-        free(cur->data);
-        free(cur->path);
-        free(cur);
-        cur = next;
-    }
-    pthread_rwlock_destroy(&cache->rwlock);
-    free(cache);
+file_cache_t* cache_create_shared(shm_cache_t* shm) {
+    size_t bytes = (sizeof(file_cache_t) + 63) & ~(size_t)63;
+    file_cache_t* cache = aligned_alloc(64, bytes);
+    if (!cache){
+        perror("Couldnt malloc cache");
+        return NULL;
+    }
+    memset(cache, 0, bytes);
+    cache->shm = shm;
+    cache->max_size = (size_t)shm->nslabs * SHM_CACHE_SLAB_SIZE;
+    return cache;
 }
 
-// Main cache get — returns malloc'd data or NULL
-unsigned char* cache_get(file_cache_t* cache, const char* path, size_t* out_size) {
-    unsigned char* result = NULL;
-    pthread_rwlock_rdlock(&cache->rwlock); //read lock so many threads can do the search at the same time
-    //entering critical region
+void cache_set_render(file_cache_t* cache, cache_render_fn render) {
+    cache->render = render;
+}
 
-    cache_entry_t* cur = cache->head;
-    while (cur) {
-        if (strcmp(cur->path, path) == 0) { //found cache entry
-            // Found entry: copy data
-            result = malloc(cur->size);
-            if (result) {
-                memcpy(result, cur->data, cur->size);
-                if (out_size) *out_size = cur->size;
-            }
-            break;
+// Destroy cache (in shared mode the segment is destroyed by the master with destroy_shared_cache)
+void cache_destroy(file_cache_t* cache) {
+    if (cache->shm) {
+        free(cache);
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        while (shard->hand) { //dropping the cache reference of every entry
+            cache_entry_t* cur = shard->hand;
+            cache_unlink(shard, cur);
+            cache_release(cur);
         }
-        cur = cur->next;
+        pthread_rwlock_destroy(&shard->rwlock);
+        free(shard->buckets);
+    }
+    free(cache);
+}
+
+void cache_release(cache_entry_t* entry) {
+    if (!entry) return;
+    // in shared mode the cache keeps its reference until the hand frees the slot under the
+    // write lock, so this never reaches 0 there
+    // acq_rel so the thread that frees sees every other thread being done with the data
+    if (atomic_fetch_sub_explicit(&entry->refcount, 1, memory_order_acq_rel) == 1) {
+        cache_free_entry(entry);
     }
-    pthread_rwlock_unlock(&cache->rwlock);
+}
+
+// Main cache get — returns the shared entry (no copy) or NULL
+cache_entry_t* cache_get(file_cache_t* cache, const char* path) {
+    unsigned long hash = cache_hash(path); // hashing doesnt need the lock
+    if (cache->shm) return shm_cache_get(cache->shm, path, hash);
+    cache_shard_t* shard = cache_shard(cache, hash);
 
-    // If found, put it at front 
+    pthread_rwlock_rdlock(&shard->rwlock); //read lock so many threads can do the search at the same time
+    //entering critical region
+    cache_entry_t* result = cache_lookup(shard, path, hash);
     if (result) {
-        pthread_rwlock_wrlock(&cache->rwlock); //write lock because we are modifying and only one thread at a time should do this
-        //entering critical region
-        cur = cache->head;
-        while (cur) {
-            if (strcmp(cur->path, path) == 0) {
-                cache_set_head(cache, cur);
-                break;
-            }
-            cur = cur->next;
-        }
-        pthread_rwlock_unlock(&cache->rwlock);
+        // take a reference while still under the lock so eviction cant free it under us
+        atomic_fetch_add_explicit(&result->refcount, 1, memory_order_relaxed);
+        // mark it as recently used, only write when needed so hot entries dont bounce between cpus
+        if (!atomic_load_explicit(&result->referenced, memory_order_relaxed))
+            atomic_store_explicit(&result->referenced, 1, memory_order_relaxed);
     }
+    pthread_rwlock_unlock(&shard->rwlock);
     return result;
 }
 
+unsigned long cache_generation(file_cache_t* cache, const char* path) {
+    if (cache->shm) return atomic_load_explicit(&cache->shm->generation, memory_order_acquire);
+    return atomic_load_explicit(&cache_shard(cache, cache_hash(path))->generation, memory_order_acquire);
+}
+
 // Insert new file into cache
-void cache_put(file_cache_t* cache, const char* path, const unsigned char* data, size_t size) {
-    if (size > MAX_CACHE_FILE_SIZE) return; 
-    pthread_rwlock_wrlock(&cache->rwlock);
+cache_entry_t* cache_put(file_cache_t* cache, const char* path, unsigned char* data, size_t size,
+                         const file_validators_t* validators, unsigned char* gzip, size_t gzip_size,
+                         unsigned long generation) {
+    unsigned long hash = cache_hash(path);
+    if (size == 0) return NULL;
+    if (!gzip) gzip_size = 0;
+    if (cache->shm) return shm_cache_put(cache->shm, path, hash, data, size, validators, gzip, gzip_size, cache->render, generation);
+    cache_shard_t* shard = cache_shard(cache, hash);
+    size_t total = size + gzip_size;
+    if (total > MAX_CACHE_FILE_SIZE || total > shard->max_size) return NULL;
 
-    // if exists, replace
-    cache_entry_t* cur = cache->head;
-    while (cur) {
-        if (strcmp(cur->path, path) == 0) {
-            // Replace data
-            free(cur->data);
-            cur->data = malloc(size);
-            if (cur->data) {
-                memcpy(cur->data, data, size);
-                cur->size = size;
-                cache_set_head(cache, cur);
-            }
-            pthread_rwlock_unlock(&cache->rwlock);
-            return;
+    // if doesnt exist, create new (done outside the lock, only the linking needs it)
+    cache_entry_t* entry = calloc(1, sizeof(cache_entry_t));
+    if (!entry) return NULL;
+    entry->path = strdup(path);//duplicate the string
+    if (!entry->path) {
+        free(entry);
+        return NULL;
+    }
+    entry->data = data;
+    entry->size = size;
+    entry->gzip = gzip;
+    entry->gzip_size = gzip_size;
+    if (validators) entry->validators = *validators; // calloc'd, none stays all zero
+    if (cache->render) {
+        char headers[CACHE_HEADERS_MAX];
+        size_t n = cache->render(entry, headers, sizeof(headers));
+        if (n > 0 && (entry->headers = malloc(n)) != NULL) {
+            memcpy(entry->headers, headers, n);
+            entry->headers_len = n;
+            total += n;
         }
-        cur = cur->next;
     }
+    entry->hash = hash;
+    atomic_init(&entry->refcount, 2); // one for the cache and one for the caller
+    atomic_init(&entry->referenced, 0);
 
-    // remove entries if needed
-    while (cache->total_size + size > cache->max_size) {
-        cache_remove_tail(cache);
-    }
+    pthread_rwlock_wrlock(&shard->rwlock);
 
-    // if doesnt exist, create new
-    cache_entry_t* entry = calloc(1, sizeof(cache_entry_t));
-    entry->path = strdup(path);//duplicate the string
-    entry->data = malloc(size);
-    if (!entry->path || !entry->data) {
+    // invalidated while it was being read: these bytes may be the version the watcher dropped
+    if (atomic_load_explicit(&shard->generation, memory_order_relaxed) != generation) {
+        pthread_rwlock_unlock(&shard->rwlock);
+        free(entry->headers);
         free(entry->path);
-        free(entry->data);
         free(entry);
-        pthread_rwlock_unlock(&cache->rwlock);
-        return;
+        return NULL;
     }
-    memcpy(entry->data, data, size);
-    entry->size = size;
 
-    // Insert at front since we are using lru type of cache
-    entry->next = cache->head;
-    if (cache->head) cache->head->prev = entry;
-    cache->head = entry;
-    if (!cache->tail) cache->tail = entry;
-    cache->total_size += size;
+    // if exists, replace (old one stays alive until its senders release it)
+    cache_entry_t* old = cache_lookup(shard, path, hash);
+    if (old) {
+        cache_unlink(shard, old);
+        cache_release(old);
+    }
 
-    pthread_rwlock_unlock(&cache->rwlock);
-}
\ No newline at end of file
+    // remove entries if needed
+    while (shard->hand && shard->total_size + total > shard->max_size) {
+        cache_evict_one(shard);
+    }
+
+    if (shard->count >= shard->nbuckets) {
+        cache_grow_index(shard);
+    }
+
+    // Insert right behind the hand so it is the last one the hand gets to
+    if (!shard->hand) {
+        entry->prev = entry->next = entry;
+        shard->hand = entry;
+    } else {
+        entry->next = shard->hand;
+        entry->prev = shard->hand->prev;
+        shard->hand->prev->next = entry;
+        shard->hand->prev = entry;
+    }
+
+    size_t b = hash & (shard->nbuckets - 1);
+    entry->hnext = shard->buckets[b];
+    shard->buckets[b] = entry;
+    entry->linked = 1;
+    shard->count++;
+    shard->total_size += total;
+
+    pthread_rwlock_unlock(&shard->rwlock);
+    return entry;
+}
+
+int cache_invalidate(file_cache_t* cache, const char* path) {
+    unsigned long hash = cache_hash(path);
+    if (cache->shm) return shm_cache_invalidate(cache->shm, path, hash);
+    cache_shard_t* shard = cache_shard(cache, hash);
+
+    pthread_rwlock_wrlock(&shard->rwlock);
+    atomic_fetch_add_explicit(&shard->generation, 1, memory_order_relaxed);
+    cache_entry_t* entry = cache_lookup(shard, path, hash);
+    if (entry) {
+        cache_unlink(shard, entry);
+        cache_release(entry); // the cache reference, senders still have theirs
+    }
+    pthread_rwlock_unlock(&shard->rwlock);
+    return entry != NULL;
+}
+
+void cache_invalidate_all(file_cache_t* cache) {
+    if (cache->shm) {
+        shm_cache_invalidate_all(cache->shm);
+        return;
+    }
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        pthread_rwlock_wrlock(&shard->rwlock);
+        atomic_fetch_add_explicit(&shard->generation, 1, memory_order_relaxed);
+        while (shard->hand) {
+            cache_entry_t* cur = shard->hand;
+            cache_unlink(shard, cur);
+            cache_release(cur);
+        }
+        pthread_rwlock_unlock(&shard->rwlock);
+    }
+}
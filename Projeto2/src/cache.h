@@ -1,40 +1,127 @@
-
 #ifndef CACHE_H
 #define CACHE_H
 
 #include <pthread.h>
 #include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
 
 
 // Max size of files to cache default: 10MB
 #define MAX_CACHE_FILE_SIZE (10*1024*1024) 
 
+// Initial number of hash buckets per shard (power of 2, doubles when the entries outnumber the buckets)
+#define CACHE_INITIAL_BUCKETS 64
+
+// Most bytes of response headers an entry keeps (see cache_set_render)
+#define CACHE_HEADERS_MAX 1024
+
+// Number of independently locked shards (power of 2), the path hash picks the shard.
+// Each shard gets max_size / CACHE_SHARDS bytes so a file bigger than that is not cached
+#define CACHE_SHARDS 16
+
+// Validators of the file an entry was read from, made once when it is cached so a hit can answer
+// If-None-Match / If-Modified-Since without a stat (fixed size, they live in the shared segment too)
+typedef struct file_validators {
+    time_t mtime;
+    char etag[64];              // "inode-size-mtime" in hex, quotes included ("" = none)
+    char last_modified[32];     // "Mon, 01 Jan 2024 12:00:00 GMT"
+} file_validators_t;
+
+// Entries are read-only once they are in the cache, threads share them instead of copying.
+// refcount = 1 for the cache itself + 1 for every thread that is still sending the data,
+// so an evicted entry is only freed when the last sender calls cache_release
 typedef struct cache_entry {
     char* path;                 // name of file
     unsigned char* data;        // file contents
     size_t size;                // size of data
-    struct cache_entry* prev;
+    unsigned char* gzip;        // gzip variant of data for text files (NULL = none), freed with it
+    size_t gzip_size;
+    char* headers;              // rendered by the cache's render function (NULL = none), freed with it
+    size_t headers_len;
+    file_validators_t validators;
+    atomic_int refcount;        // references still alive (cache + senders)
+    atomic_int referenced;      // CLOCK bit, set on every hit and cleared by the hand
+    unsigned long hash;         // hash of path, computed once at insert
+    int linked;                 // 1 while the entry is in the ring/index (0 after eviction)
+    struct cache_entry* hnext;  // next entry in the same hash bucket
+    struct cache_entry* prev;   // CLOCK ring (circular)
     struct cache_entry* next;
 } cache_entry_t;
 
+// One shard = one small cache with its own lock, index and CLOCK ring
+typedef struct cache_shard {
+    _Alignas(64) pthread_rwlock_t rwlock; // aligned so two shards never share a cache line
+    cache_entry_t* hand;        // CLOCK hand, next candidate for eviction
+    cache_entry_t** buckets;    // hash index by path
+    size_t nbuckets;            // always a power of 2
+    size_t count;               // number of entries
+    size_t total_size;          // total bytes in shard
+    size_t max_size;            // maximum bytes in shard
+    atomic_ulong generation;    // bumped (write lock held) by every invalidate, see cache_generation
+} cache_shard_t;
+
+// Cross-process cache segment (CACHE_MODE=shared), defined in shared_mem.h
+typedef struct shm_cache shm_cache_t;
+
+// Writes at most max bytes of response headers for an entry about to be inserted (path, data, gzip
+// and validators are set) and returns how many, 0 for none. They are kept with the entry
+typedef size_t (*cache_render_fn)(const cache_entry_t* entry, char* out, size_t max);
+
 typedef struct file_cache {
-    cache_entry_t* head;        // most recent
-    cache_entry_t* tail;        // least recent
-    size_t total_size;          // total bytes in cache
-    size_t max_size;            // maximum bytes 
-    pthread_rwlock_t rwlock;    // reader-writer lock for cache (so that it can be thread-safe so more efficient)
+    cache_shard_t shards[CACHE_SHARDS];
+    size_t max_size;            // maximum bytes (all shards)
+    shm_cache_t* shm;           // if set every operation goes to the shared segment instead of the shards
+    cache_render_fn render;     // NULL = entries have no headers
 } file_cache_t;
 
+// Hash of a path as the cache indexes it (FNV-1a + a final mix, so high and low bits are both
+// usable), also used by the fd cache and the preload for their own tables
+unsigned long cache_hash(const char* path);
+
+// Shard (0..CACHE_SHARDS-1) of the entries with this hash (not used in shared mode)
+int cache_shard_index(unsigned long hash);
+
 //create the cache
 file_cache_t* cache_create(size_t max_size);
 
+// create a cache on top of a segment from create_shared_cache (call before fork so all workers share it)
+file_cache_t* cache_create_shared(shm_cache_t* shm);
+
 // Destroy cache
 void cache_destroy(file_cache_t* cache);
 
-// Main cache get — returns malloc'd data or NULL
-unsigned char* cache_get(file_cache_t* cache, const char* path, size_t* out_size);
+// Render the headers of every entry from now on with render (at insert, so a hit only copies them).
+// Set it before anything is cached, and before fork in shared mode so every worker renders the same
+void cache_set_render(file_cache_t* cache, cache_render_fn render);
+
+// Main cache get — returns the entry with a reference held (call cache_release when done) or NULL.
+// A hit only takes the shard read lock
+cache_entry_t* cache_get(file_cache_t* cache, const char* path);
+
+// Read before reading a file that is going to be cached and pass it to cache_put: if path was
+// invalidated in between (the watcher saw the file change) the bytes may be the old version and
+// cache_put refuses them instead of caching them until eviction
+unsigned long cache_generation(file_cache_t* cache, const char* path);
+
+// Insert file into cache, takes ownership of data (must be malloc'd, in shared mode it is copied
+// into the segment and freed) and of gzip, its compressed variant (same, NULL = none, see gzip.h).
+// Both count against the cache size. validators are copied into the entry (NULL = none).
+// generation is what cache_generation returned before the file was read.
+// Returns the new entry with a reference held for the caller, or NULL if it wasn't cached
+// (too big, out of memory or invalidated meanwhile) and in that case the caller still owns data and gzip
+cache_entry_t* cache_put(file_cache_t* cache, const char* path, unsigned char* data, size_t size,
+                         const file_validators_t* validators, unsigned char* gzip, size_t gzip_size,
+                         unsigned long generation);
+
+// Drop a reference taken by cache_get/cache_put
+void cache_release(cache_entry_t* entry);
+
+// Take path out of the cache (the file changed), threads still sending it keep their copy until
+// they release it. Returns 1 if it was cached
+int cache_invalidate(file_cache_t* cache, const char* path);
 
-// Insert file into cache
-void cache_put(file_cache_t* cache, const char* path, const unsigned char* data, size_t size);
+// Same for every entry
+void cache_invalidate_all(file_cache_t* cache);
 
-#endif
\ No newline at end of file
+#endif
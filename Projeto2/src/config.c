@@ -3,10 +3,24 @@
 #include <stdlib.h>
 #include <string.h>
 
+// a string value into its fixed size field, cut (and said so) if it doesnt fit
+static void set_string(char* field, size_t size, const char* key, const char* value) {
+    size_t len = strlen(value);
+    if (len >= size) {
+        fprintf(stderr, "%s longer than %zu characters, cut\n", key, size - 1);
+        len = size - 1;
+    }
+    memcpy(field, value, len);
+    field[len] = '\0';
+}
+
 int load_server_config(const char* filename, server_config_t* config) {
     FILE* file = fopen(filename, "r");
     if (!file) return -1;
 
+    // keys missing from the file stay 0 (everyone that reads them has a default for 0)
+    memset(config, 0, sizeof(*config));
+
     char line[256];
     while (fgets(line, sizeof(line), file)) {
         // Skip comments and empty lines
@@ -16,7 +30,7 @@ int load_server_config(const char* filename, server_config_t* config) {
             if (strcmp(key, "PORT") == 0)
                 config->port = atoi(value);
             else if (strcmp(key, "DOCUMENT_ROOT") == 0)
-                strncpy(config->document_root, value, sizeof(config->document_root)-1);
+                set_string(config->document_root, sizeof(config->document_root), key, value);
             else if (strcmp(key, "NUM_WORKERS") == 0)
                 config->num_workers = atoi(value);
             else if (strcmp(key, "THREADS_PER_WORKER") == 0)
@@ -24,11 +38,39 @@ int load_server_config(const char* filename, server_config_t* config) {
             else if (strcmp(key, "MAX_QUEUE_SIZE") == 0)
                 config->max_queue_size = atoi(value);
             else if (strcmp(key, "LOG_FILE") == 0)
-                strncpy(config->log_file, value, sizeof(config->log_file)-1);
+                set_string(config->log_file, sizeof(config->log_file), key, value);
             else if (strcmp(key, "CACHE_SIZE_MB") == 0)
                 config->cache_size_mb = atoi(value);
             else if (strcmp(key, "TIMEOUT_SECONDS") == 0)
                 config->timeout_seconds = atoi(value);
+            else if (strcmp(key, "CACHE_MODE") == 0)
+                config->cache_shared = (strcmp(value, "shared") == 0);
+            else if (strcmp(key, "CACHE_PRELOAD") == 0)
+                set_string(config->cache_preload, sizeof(config->cache_preload), key, value);
+            else if (strcmp(key, "SENDFILE_THRESHOLD_KB") == 0)
+                config->sendfile_threshold_kb = atoi(value);
+            else if (strcmp(key, "KEEPALIVE_MAX_REQUESTS") == 0)
+                config->keepalive_max_requests = atoi(value);
+            else if (strcmp(key, "WORKER_MODE") == 0)
+                config->worker_mode = (strcmp(value, "epoll") == 0) ? WORKER_MODE_EPOLL : WORKER_MODE_THREADS;
+            else if (strcmp(key, "LISTEN_MODE") == 0)
+                config->listen_mode = (strcmp(value, "worker") == 0) ? LISTEN_MODE_WORKER :
+                                      (strcmp(value, "thread") == 0) ? LISTEN_MODE_THREAD :
+                                      (strcmp(value, "dispatch") == 0) ? LISTEN_MODE_DISPATCH : LISTEN_MODE_SHARED;
+            else if (strcmp(key, "REUSEPORT_CPU_AFFINITY") == 0)
+                config->reuseport_cpu = atoi(value);
+            else if (strcmp(key, "QUEUE_TARGET_MS") == 0)
+                config->queue_target_ms = atoi(value);
+            else if (strcmp(key, "QUEUE_INTERVAL_MS") == 0)
+                config->queue_interval_ms = atoi(value);
+            else if (strcmp(key, "QUEUE_DEADLINE_MS") == 0)
+                config->queue_deadline_ms = atoi(value);
+            else if (strcmp(key, "FD_CACHE_ENTRIES") == 0)
+                config->fd_cache_entries = atoi(value);
+            else if (strcmp(key, "FD_CACHE_TTL_SECONDS") == 0)
+                config->fd_cache_ttl_seconds = atoi(value);
+            else if (strcmp(key, "TRACE_REQUESTS") == 0)
+                config->trace_requests = atoi(value);
         }
     }
     fclose(file);
@@ -1,6 +1,28 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+// files of at least this size are streamed with sendfile() (SENDFILE_THRESHOLD_KB)
+#define DEFAULT_SENDFILE_THRESHOLD_KB 256
+
+// open files kept per worker (FD_CACHE_ENTRIES, -1 = off) and for how long (FD_CACHE_TTL_SECONDS)
+#define DEFAULT_FD_CACHE_ENTRIES 256
+#define DEFAULT_FD_CACHE_TTL_SECONDS 2
+
+// load shedding on the thread pool queue (QUEUE_TARGET_MS, QUEUE_INTERVAL_MS, QUEUE_DEADLINE_MS)
+#define DEFAULT_QUEUE_TARGET_MS 20      // waiting this long in the queue is still fine
+#define DEFAULT_QUEUE_INTERVAL_MS 100   // above target for this long -> start shedding
+#define DEFAULT_QUEUE_DEADLINE_MS 1000  // waited this long -> always shed, the client gave up or will soon
+
+// WORKER_MODE: how a worker process serves its connections
+#define WORKER_MODE_THREADS 0   // thread pool, a thread per request (blocking sockets)
+#define WORKER_MODE_EPOLL   1   // one epoll event loop per thread, non blocking sockets
+
+// LISTEN_MODE: who accepts on which listening socket
+#define LISTEN_MODE_SHARED 0    // one socket, every worker accepts on it
+#define LISTEN_MODE_WORKER 1    // one SO_REUSEPORT socket per worker
+#define LISTEN_MODE_THREAD 2    // one SO_REUSEPORT socket per event loop thread (epoll mode only)
+#define LISTEN_MODE_DISPATCH 3  // only the master accepts, fds go to the least loaded worker
+
 typedef struct {
     int port;
     char document_root[256];
@@ -10,6 +32,19 @@ typedef struct {
     char log_file[128];
     int cache_size_mb;
     int timeout_seconds;
+    int cache_shared;           // CACHE_MODE=shared -> one cache in shared memory for all workers
+    char cache_preload[192];    // CACHE_PRELOAD=off|docroot|<manifest or access log>, filled before fork
+    int sendfile_threshold_kb;  // files this big or bigger are sent with sendfile()
+    int keepalive_max_requests; // requests per keep-alive connection before we close it
+    int worker_mode;            // WORKER_MODE=threads|epoll
+    int listen_mode;            // LISTEN_MODE=shared|worker|thread|dispatch
+    int reuseport_cpu;          // REUSEPORT_CPU_AFFINITY=1 -> connections steered by cpu, owners pinned
+    int queue_target_ms;        // CoDel target: acceptable time an fd waits in the pool queue
+    int queue_interval_ms;      // CoDel interval: how long it can stay above target before we shed
+    int queue_deadline_ms;      // fds that waited longer get a 503 without being read
+    int fd_cache_entries;       // open fds (and missing paths) remembered per worker, -1 = off
+    int fd_cache_ttl_seconds;   // how long one is trusted before the path is opened again
+    int trace_requests;         // TRACE_REQUESTS=1 -> per request phase timings (SIGUSR1 / /server-stats/trace)
 } server_config_t;
 
 int load_server_config(const char* filename, server_config_t* config);
@@ -0,0 +1,196 @@
+// conn.c
+#include "conn.h"
+#include "logger.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+
+// table indexed by fd (the kernel never gives the same fd to two open sockets of the process)
+static conn_t** g_conns;
+static int g_max_fds;
+
+static thread_pool_t* g_pool;
+static atomic_int* g_inflight;
+static int g_timeout = 30;
+static int g_epfd = -1;
+
+// idle list, parked connections in the order they were parked so the oldest is always first
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static conn_t* idle_head;
+static conn_t* idle_tail;
+
+static time_t now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// idle_mutex must be held
+static void idle_remove(conn_t* c) {
+    if (c->prev) c->prev->next = c->next;
+    else idle_head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else idle_tail = c->prev;
+    c->prev = c->next = NULL;
+    c->parked = 0;
+}
+
+static void* idle_poller(void* arg) {
+    (void)arg;
+    struct epoll_event events[256];
+
+    while (1) {
+        // wake at least once a second to close the connections that timed out
+        int n = epoll_wait(g_epfd, events, 256, 1000);
+        if (n < 0 && errno != EINTR) {
+            LOG_ERROR("epoll_wait: %s", strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            conn_t* c = (fd >= 0 && fd < g_max_fds) ? g_conns[fd] : NULL;
+            int ready = 0;
+            pthread_mutex_lock(&idle_mutex);
+            if (c && c->parked) { // it could have timed out and been closed already
+                idle_remove(c);
+                ready = 1;
+            }
+            pthread_mutex_unlock(&idle_mutex);
+            // client sent something (or hung up), a pool thread reads it
+            if (ready) thread_addFd(g_pool, fd);
+        }
+
+        // close the ones that were idle for too long
+        time_t now = now_seconds();
+        conn_t* expired = NULL;
+        pthread_mutex_lock(&idle_mutex);
+        while (idle_head && now - idle_head->last_active >= g_timeout) {
+            conn_t* c = idle_head;
+            idle_remove(c);
+            c->next = expired;
+            expired = c;
+        }
+        pthread_mutex_unlock(&idle_mutex);
+        while (expired) {
+            conn_t* next = expired->next;
+            conn_close(expired);
+            expired = next;
+        }
+    }
+    return NULL;
+}
+
+int conn_init(thread_pool_t* pool, int timeout_seconds) {
+    struct rlimit rl;
+    g_max_fds = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur > 1024)
+        g_max_fds = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > CONN_MAX_FDS) ? CONN_MAX_FDS : (int)rl.rlim_cur;
+    g_conns = calloc(g_max_fds, sizeof(conn_t*));
+    if (!g_conns) return -1;
+
+    g_pool = pool;
+    if (timeout_seconds > 0) g_timeout = timeout_seconds;
+    if (!pool) return 0;
+
+    g_epfd = epoll_create1(0);
+    if (g_epfd < 0) return -1;
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, idle_poller, NULL) != 0) return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+void conn_set_inflight(atomic_int* counter) {
+    g_inflight = counter;
+}
+
+conn_t* conn_get(int fd) {
+    if (fd < 0 || fd >= g_max_fds) return NULL;
+    conn_t* c = g_conns[fd];
+    if (!c) {
+        c = malloc(sizeof(conn_t));
+        if (!c) return NULL;
+        // a new connection. Every response is written in one call (MSG_MORE when a file follows),
+        // so Nagle would only hold back its last segment until the client acks the one before
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->fd = fd;
+        c->len = 0;
+        c->buf[0] = '\0';
+        http_parser_reset(&c->parser);
+        c->requests = 0;
+        http_response_init(&c->resp);
+        c->state = CONN_READING;
+        c->events = 0;
+        c->last_active = 0;
+        c->parked = 0;
+        c->in_epoll = 0;
+        c->prev = c->next = NULL;
+        g_conns[fd] = c;
+    }
+    return c;
+}
+
+void conn_park(conn_t* c) {
+    // on the list before it is armed, so the poller always finds it parked when the event comes
+    pthread_mutex_lock(&idle_mutex);
+    c->last_active = now_seconds();
+    c->parked = 1;
+    c->prev = idle_tail;
+    c->next = NULL;
+    if (idle_tail) idle_tail->next = c;
+    else idle_head = c;
+    idle_tail = c;
+    pthread_mutex_unlock(&idle_mutex);
+
+    // oneshot: after one event the fd is disarmed until it is parked again
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, .data.fd = c->fd };
+    int op = c->in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(g_epfd, op, c->fd, &ev) == 0) {
+        c->in_epoll = 1;
+        return;
+    }
+
+    LOG_ERROR("epoll_ctl: %s", strerror(errno));
+    int owned = 0;
+    pthread_mutex_lock(&idle_mutex);
+    if (c->parked) { // still ours, nobody else can close it
+        idle_remove(c);
+        owned = 1;
+    }
+    pthread_mutex_unlock(&idle_mutex);
+    if (owned) conn_close(c);
+}
+
+void conn_close(conn_t* c) {
+    if (!c) return;
+    g_conns[c->fd] = NULL; // before close, the fd number can be reused right after
+    // close() alone keeps the registration while another fd (the master's copy in dispatch mode)
+    // still refers to the socket
+    if (c->in_epoll) epoll_ctl(g_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    http_response_free(&c->resp);
+    free(c);
+    if (g_inflight) atomic_fetch_sub_explicit(g_inflight, 1, memory_order_relaxed);
+}
+
+void conn_drop(int fd) {
+    conn_t* c = (fd >= 0 && fd < g_max_fds) ? g_conns[fd] : NULL;
+    if (c) { // a parked keep-alive connection that came back through the queue
+        conn_close(c);
+        return;
+    }
+    close(fd);
+    if (g_inflight) atomic_fetch_sub_explicit(g_inflight, 1, memory_order_relaxed);
+}
@@ -0,0 +1,63 @@
+// conn.h
+#ifndef CONN_H
+#define CONN_H
+
+#include <time.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "thread_pool.h"
+#include "http.h"
+
+// biggest request header we accept (bigger ones get a 400)
+#define CONN_BUF_SIZE 8192
+
+// default for KEEPALIVE_MAX_REQUESTS, after this many requests the connection is closed
+#define DEFAULT_KEEPALIVE_MAX 100
+
+// biggest fd the connection table covers (sockets past it are refused)
+#define CONN_MAX_FDS (1 << 20)
+
+// what the connection is waiting for (epoll mode)
+#define CONN_READING 0
+#define CONN_WRITING 1
+
+// Per connection state, kept between requests of the same keep-alive connection.
+// Only one thread owns a connection at a time (a pool thread, the idle poller or an event loop)
+typedef struct conn {
+    int fd;
+    char buf[CONN_BUF_SIZE];    // bytes received and not handled yet (always '\0' terminated)
+    size_t len;
+    http_parser_t parser;       // how far into buf the request header was parsed
+    int requests;               // requests already answered on this connection
+    http_response_t resp;       // response being written
+    int state;                  // CONN_READING / CONN_WRITING
+    unsigned int events;        // epoll events it is registered for (epoll mode)
+    time_t last_active;         // when it was parked or last did something (monotonic seconds)
+    int parked;                 // waiting in the idle poller
+    int in_epoll;               // registered in the idle poller epoll (so next park is a MOD)
+    struct conn* prev;          // idle list (threads mode) or the event loop list, oldest first
+    struct conn* next;
+} conn_t;
+
+// Start the idle poller: parked connections wait there (without a pool thread) until the client
+// sends the next request, then go back to the pool. After timeout_seconds idle they are closed.
+// With pool NULL only the connection table is set up (the event loops do their own polling)
+int conn_init(thread_pool_t* pool, int timeout_seconds);
+
+// LISTEN_MODE=dispatch: every closed connection decrements counter (the worker's inflight)
+void conn_set_inflight(atomic_int* counter);
+
+// State of fd, created the first time a pool thread sees it
+conn_t* conn_get(int fd);
+
+// Hand an idle keep-alive connection to the poller
+void conn_park(conn_t* c);
+
+// Close the socket and free its state
+void conn_close(conn_t* c);
+
+// Close a client fd without a conn_t at hand (no memory, fd past the table, shed from the queue).
+// If it does have one it is freed too
+void conn_drop(int fd);
+
+#endif
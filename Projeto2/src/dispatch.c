@@ -0,0 +1,81 @@
+// dispatch.c
+#include "dispatch.h"
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+int create_dispatch_channels(int nworkers, int* channels) {
+    for (int i = 0; i < nworkers; i++) {
+        // seqpacket keeps message boundaries, each fd arrives alone with its one byte of payload
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, channels + i * 2) != 0) {
+            while (--i >= 0) {
+                close(channels[i * 2]);
+                close(channels[i * 2 + 1]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int send_fd(int sock, int fd) {
+    char byte = 'F'; // at least one byte of data must go with the fd
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union { // aligned buffer for the control message
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS; // the kernel installs a copy of fd in the receiving process
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    while (1) {
+        if (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == 1) return 0;
+        if (errno != EINTR) return -1;
+    }
+}
+
+int recv_fd(int sock, int flags) {
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(sock, &msg, flags | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) { // master closed its end
+        errno = EPIPE;
+        return -1;
+    }
+    if (n < 0) return -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EBADMSG;
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
@@ -0,0 +1,18 @@
+// dispatch.h
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+// LISTEN_MODE=dispatch: the master accepts every connection and passes the fd to a worker over a
+// unix socketpair (SCM_RIGHTS). One SOCK_SEQPACKET pair per worker, one message per fd
+
+// channels[i*2] stays in the master, channels[i*2+1] goes to worker i. Returns 0 or -1
+int create_dispatch_channels(int nworkers, int* channels);
+
+// Send fd over sock without blocking. 0 ok, -1 on error (EAGAIN: the worker is not keeping up)
+int send_fd(int sock, int fd);
+
+// Receive one fd (flags: 0 or MSG_DONTWAIT). Returns the fd or -1 (errno EAGAIN: nothing yet,
+// EPIPE: the master went away and the worker should stop)
+int recv_fd(int sock, int flags);
+
+#endif
@@ -0,0 +1,192 @@
+// error_pages.c
+#include "error_pages.h"
+#include "http.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// a bigger errors/errorNNN.html is not worth keeping in memory, it gets the plain text body
+#define ERROR_PAGE_MAX_SIZE (64 * 1024)
+
+// the error codes the server sends
+static const struct {
+    int status;
+    const char* msg;
+} g_codes[] = {
+    { 400, "Bad Request" },
+    { 403, "Forbidden" },
+    { 404, "Not Found" },
+    { 405, "Method Not Allowed" },
+    { 414, "URI Too Long" },
+    { 416, "Range Not Satisfiable" },
+    { 500, "Internal Server Error" },
+};
+#define NCODES (sizeof(g_codes) / sizeof(g_codes[0]))
+
+// what the file looked like when it was rendered, a different one means render again
+typedef struct {
+    int exists;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} file_stamp_t;
+
+struct error_pages {
+    atomic_int refcount;        // 1 while it is the current set + 1 for every response still using it
+    file_stamp_t stamps[NCODES];
+    error_page_t pages[NCODES][2]; // [code][keep_alive]
+};
+
+static char g_errors_dir[512];
+static struct error_pages* g_current;
+static pthread_rwlock_t g_lock = PTHREAD_RWLOCK_INITIALIZER; // writers only to swap g_current
+static atomic_long g_last_check;    // second of the last look at the files
+
+static void stamp_file(const char* path, file_stamp_t* st) {
+    struct stat sb;
+    memset(st, 0, sizeof(*st));
+    if (stat(path, &sb) != 0) return;
+    st->exists = 1;
+    st->ino = sb.st_ino;
+    st->size = sb.st_size;
+    st->mtime = sb.st_mtim;
+}
+
+static int same_stamp(const file_stamp_t* a, const file_stamp_t* b) {
+    return a->exists == b->exists && a->ino == b->ino && a->size == b->size &&
+           a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec == b->mtime.tv_nsec;
+}
+
+// errorNNN.html in a malloc'd buffer, NULL if there is none (or it is too big/unreadable)
+static char* read_page(const char* path, size_t* len) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat sb;
+    char* data = NULL;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size <= ERROR_PAGE_MAX_SIZE) {
+        data = malloc(sb.st_size > 0 ? (size_t)sb.st_size : 1);
+        if (data && read(fd, data, (size_t)sb.st_size) != sb.st_size) {
+            free(data);
+            data = NULL;
+        }
+        *len = (size_t)sb.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+// headers (all but the status line and Date) and body in one block
+static int render(error_page_t* page, const char* type, const char* body, size_t body_len, int keep_alive) {
+    char fields[512];
+    size_t fields_len = http_render_fields(fields, sizeof(fields), type, body_len, keep_alive);
+    char* data = malloc(fields_len + body_len);
+    if (!data) return -1;
+    memcpy(data, fields, fields_len);
+    memcpy(data + fields_len, body, body_len);
+    page->data = data;
+    page->len = fields_len + body_len;
+    page->header_len = fields_len;
+    return 0;
+}
+
+static void free_set(struct error_pages* set) {
+    for (size_t i = 0; i < NCODES; i++)
+        for (int k = 0; k < 2; k++) free((char*)set->pages[i][k].data);
+    free(set);
+}
+
+static struct error_pages* load_set(void) {
+    struct error_pages* set = calloc(1, sizeof(*set));
+    if (!set) return NULL;
+    atomic_init(&set->refcount, 1);
+    for (size_t i = 0; i < NCODES; i++) {
+        char path[600];
+        snprintf(path, sizeof(path), "%s/error%d.html", g_errors_dir, g_codes[i].status);
+        stamp_file(path, &set->stamps[i]);
+
+        size_t len = 0;
+        char* html = read_page(path, &len);
+        char text[64];
+        const char* type = "text/html";
+        const char* body = html;
+        if (!html) { // Fallback: plain text message
+            len = (size_t)snprintf(text, sizeof(text), "%d %s\n", g_codes[i].status, g_codes[i].msg);
+            type = "text/plain";
+            body = text;
+        }
+        int failed = 0;
+        for (int k = 0; k < 2; k++)
+            if (render(&set->pages[i][k], type, body, len, k) != 0) failed = 1;
+        free(html);
+        if (failed) {
+            free_set(set);
+            return NULL;
+        }
+    }
+    return set;
+}
+
+int error_pages_init(const char* document_root) {
+    snprintf(g_errors_dir, sizeof(g_errors_dir), "%s/errors", document_root);
+    g_current = load_set();
+    atomic_store(&g_last_check, (long)time(NULL));
+    return g_current ? 0 : -1;
+}
+
+// one thread per second stats the files, a new set replaces the current one if any of them changed
+static void check_files(void) {
+    long now = (long)time(NULL);
+    long last = atomic_load_explicit(&g_last_check, memory_order_relaxed);
+    if (now == last || !atomic_compare_exchange_strong(&g_last_check, &last, now)) return;
+
+    pthread_rwlock_rdlock(&g_lock);
+    struct error_pages* cur = g_current;
+    int changed = !cur;
+    for (size_t i = 0; cur && i < NCODES && !changed; i++) {
+        char path[600];
+        file_stamp_t st;
+        snprintf(path, sizeof(path), "%s/error%d.html", g_errors_dir, g_codes[i].status);
+        stamp_file(path, &st);
+        changed = !same_stamp(&st, &cur->stamps[i]);
+    }
+    pthread_rwlock_unlock(&g_lock);
+    if (!changed) return;
+
+    struct error_pages* set = load_set();
+    if (!set) return; // keep the old ones, try again in a second
+    pthread_rwlock_wrlock(&g_lock);
+    struct error_pages* old = g_current;
+    g_current = set;
+    pthread_rwlock_unlock(&g_lock);
+    error_pages_release(old); // freed once the last response using it was sent
+    LOG_INFO("Error pages in %s reloaded", g_errors_dir);
+}
+
+const error_page_t* error_pages_get(int status, int keep_alive, struct error_pages** set) {
+    check_files();
+    *set = NULL;
+    size_t i = 0;
+    while (i < NCODES && g_codes[i].status != status) i++;
+    if (i == NCODES) return NULL;
+
+    pthread_rwlock_rdlock(&g_lock);
+    struct error_pages* cur = g_current;
+    if (cur) atomic_fetch_add_explicit(&cur->refcount, 1, memory_order_relaxed);
+    pthread_rwlock_unlock(&g_lock);
+    if (!cur) return NULL;
+    *set = cur;
+    return &cur->pages[i][keep_alive ? 1 : 0];
+}
+
+void error_pages_release(struct error_pages* set) {
+    if (set && atomic_fetch_sub_explicit(&set->refcount, 1, memory_order_acq_rel) == 1) free_set(set);
+}
@@ -0,0 +1,32 @@
+// error_pages.h
+#ifndef ERROR_PAGES_H
+#define ERROR_PAGES_H
+
+#include <stddef.h>
+
+// An error response but for its status line and Date (http_status_lines, the only part that changes):
+// headers and body in one block, so it goes out in the same send as those two lines and nothing
+// else is built or read per request
+typedef struct {
+    const char* data;
+    size_t len;
+    size_t header_len;  // the body starts here
+} error_page_t;
+
+// One rendering of all the pages, shared by the responses still being sent when it is replaced
+struct error_pages;
+
+// Render the responses of the error codes the server sends from document_root/errors/errorNNN.html
+// (a plain text body for the ones without a file). Called at worker start, after
+// http_set_keepalive since the Keep-Alive header is part of them. -1 if out of memory
+int error_pages_init(const char* document_root);
+
+// The response for status, keep_alive picks the "Connection: keep-alive" one. *set gets a reference
+// on what it points into, release it with error_pages_release once it was sent. At most once a
+// second this looks at the files and renders them again if one changed.
+// NULL (and *set NULL) for a status without a page
+const error_page_t* error_pages_get(int status, int keep_alive, struct error_pages** set);
+
+void error_pages_release(struct error_pages* set);
+
+#endif
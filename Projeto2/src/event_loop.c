@@ -0,0 +1,265 @@
+// event_loop.c
+#define _GNU_SOURCE // accept4
+#include "event_loop.h"
+#include "conn.h"
+#include "worker.h"
+#include "http.h"
+#include "dispatch.h"
+#include "trace.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define MAX_EVENTS 256
+
+// One per thread, a connection stays on the loop that accepted it until it is closed
+typedef struct {
+    int listen_fd;
+    int epfd;
+    int cpu;        // pinned here (-1 = not pinned)
+    int dispatched; // listen_fd is the channel from the master (LISTEN_MODE=dispatch), not a TCP socket
+    conn_t* head;   // connections of this loop, least recently active first (for the timeout sweep)
+    conn_t* tail;
+} event_loop_t;
+
+static int g_timeout = 30;
+
+static time_t now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void list_remove(event_loop_t* loop, conn_t* c) {
+    if (c->prev) c->prev->next = c->next;
+    else loop->head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else loop->tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static void list_append(event_loop_t* loop, conn_t* c) {
+    c->prev = loop->tail;
+    c->next = NULL;
+    if (loop->tail) loop->tail->next = c;
+    else loop->head = c;
+    loop->tail = c;
+}
+
+// the connection did something: move it to the end so the oldest stays at the head
+static void touch(event_loop_t* loop, conn_t* c, time_t now) {
+    c->last_active = now;
+    if (loop->tail != c) {
+        list_remove(loop, c);
+        list_append(loop, c);
+    }
+}
+
+static void loop_close(event_loop_t* loop, conn_t* c) {
+    if (c->state == CONN_WRITING) worker_finish_response(c, 0); // stats and log for the cut response
+    list_remove(loop, c);
+    // close() only drops the epoll registration when no other fd shares the socket, and the
+    // master may still hold its copy for a moment after passing it to us (dispatch mode)
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    conn_close(c);
+}
+
+// level triggered, only call epoll_ctl when the direction changes
+static int want(event_loop_t* loop, conn_t* c, unsigned int events) {
+    events |= EPOLLRDHUP;
+    if (c->events == events) return 0;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0) return -1;
+    c->events = events;
+    return 0;
+}
+
+// The per connection state machine: read until there is a full request, build the response,
+// write it until the socket is full, then come back when epoll says it is readable/writable again
+static void conn_process(event_loop_t* loop, conn_t* c) {
+    if (TRACE_ON()) trace_resume(&c->resp.trace);
+    while (1) {
+        if (c->state == CONN_WRITING) {
+            int r = http_response_write(c->fd, &c->resp);
+            TRACE_MARK(&c->resp.trace, TRACE_SEND);
+            if (r == 0) { // socket buffer full, continue when the client read some of it
+                if (want(loop, c, EPOLLOUT) != 0) loop_close(loop, c);
+                return;
+            }
+            c->state = CONN_READING;
+            if (!worker_finish_response(c, r == 1)) {
+                loop_close(loop, c);
+                return;
+            }
+        }
+
+        // pipelined requests are already in the buffer, answer them before reading more
+        if (worker_next_response(c)) {
+            c->state = CONN_WRITING;
+            continue;
+        }
+
+        int r = worker_read_request(c);
+        if (r > 0) continue;
+        if (r < 0 || want(loop, c, EPOLLIN) != 0) loop_close(loop, c);
+        return;
+    }
+}
+
+static void accept_connections(event_loop_t* loop, time_t now) {
+    while (1) {
+        int client_fd;
+        if (loop->dispatched) {
+            client_fd = recv_fd(loop->listen_fd, MSG_DONTWAIT);
+            if (client_fd >= 0) fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) | O_NONBLOCK);
+        } else {
+            client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        }
+        if (client_fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return; // another loop got it or nothing left
+            if (errno == EPIPE) { // the master is gone: no new connections, finish the ones we have
+                epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listen_fd, NULL);
+                return;
+            }
+            LOG_ERROR("%s: %s", loop->dispatched ? "recv_fd" : "accept4", strerror(errno));
+            return;
+        }
+
+        conn_t* c = conn_get(client_fd);
+        if (!c) {
+            conn_drop(client_fd);
+            continue;
+        }
+        c->state = CONN_READING;
+        c->events = EPOLLIN | EPOLLRDHUP;
+        struct epoll_event ev = { .events = c->events, .data.ptr = c };
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, client_fd, &ev) != 0) {
+            LOG_ERROR("epoll_ctl: %s", strerror(errno));
+            conn_close(c);
+            continue;
+        }
+        c->last_active = now;
+        list_append(loop, c);
+
+        // with TCP_DEFER_ACCEPT the request is usually there already, no need to wait for epoll
+        conn_process(loop, c);
+    }
+}
+
+static void* event_loop_run(void* arg) {
+    event_loop_t* loop = (event_loop_t*)arg;
+    struct epoll_event events[MAX_EVENTS];
+    time_t last_sweep = now_seconds();
+    if (loop->cpu >= 0) worker_pin_cpu(loop->cpu);
+
+    while (1) {
+        // wake at least once a second to close the connections that timed out
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("epoll_wait: %s", strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        time_t now = now_seconds();
+        for (int i = 0; i < n; i++) {
+            conn_t* c = events[i].data.ptr;
+            if (!c) { // the listen socket
+                accept_connections(loop, now);
+                continue;
+            }
+            touch(loop, c, now);
+            conn_process(loop, c); // errors and hangups show up as a failed recv/send there
+        }
+
+        if (now != last_sweep) {
+            last_sweep = now;
+            // idle keep-alive connections and clients that stopped reading their response
+            while (loop->head && now - loop->head->last_active >= g_timeout)
+                loop_close(loop, loop->head);
+        }
+    }
+    return NULL;
+}
+
+static event_loop_t* event_loop_create(int listen_fd, int cpu, int dispatched) {
+    event_loop_t* loop = calloc(1, sizeof(event_loop_t));
+    if (!loop) return NULL;
+    loop->listen_fd = listen_fd;
+    loop->cpu = cpu;
+    loop->dispatched = dispatched;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        free(loop);
+        return NULL;
+    }
+
+    // with a shared listen socket every loop (of every worker) waits on it, EPOLLEXCLUSIVE wakes only
+    // one of them per new connection instead of all of them (older kernels: plain EPOLLIN)
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL };
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+        ev.events = EPOLLIN;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+            close(loop->epfd);
+            free(loop);
+            return NULL;
+        }
+    }
+    return loop;
+}
+
+void run_event_loops(int* listen_fds, int nlisten, int nthreads, int timeout_seconds, int first_cpu,
+                     int dispatched) {
+    if (timeout_seconds > 0) g_timeout = timeout_seconds;
+    if (nthreads < 1) nthreads = 1;
+
+    // each connection is one fd, go as high as we are allowed (the default 1024 is way too low)
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max && rl.rlim_cur < CONN_MAX_FDS) {
+        rl.rlim_cur = rl.rlim_max > CONN_MAX_FDS ? CONN_MAX_FDS : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (conn_init(NULL, timeout_seconds) != 0) {
+        LOG_ERROR("Couldnt create connection table: %s", strerror(errno));
+        return;
+    }
+
+    // accept() must not block a loop when another one took the connection first
+    for (int i = 0; i < nlisten; i++) {
+        int flags = fcntl(listen_fds[i], F_GETFL, 0);
+        fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK);
+    }
+
+    // this thread runs the last loop itself
+    for (int i = 0; i < nthreads; i++) {
+        event_loop_t* loop = event_loop_create(listen_fds[i % nlisten], first_cpu >= 0 ? first_cpu + i : -1, dispatched);
+        if (!loop) {
+            LOG_ERROR("Couldnt create event loop: %s", strerror(errno));
+            return;
+        }
+        if (i == nthreads - 1) {
+            event_loop_run(loop);
+            return;
+        }
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, event_loop_run, loop) != 0) {
+            LOG_ERROR("Couldnt create event loop thread: %s", strerror(errno));
+            close(loop->epfd);
+            free(loop);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
@@ -0,0 +1,15 @@
+// event_loop.h
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+// WORKER_MODE=epoll: nthreads threads, each with its own epoll loop that accepts on a listen socket
+// and drives its connections through read -> parse -> respond -> write without ever blocking, so a
+// worker holds thousands of (mostly idle keep-alive) connections with a handful of threads.
+// Loop i accepts on listen_fds[i % nlisten] (all on the same one, or each on its own SO_REUSEPORT
+// socket) and, if first_cpu >= 0, runs pinned to cpu first_cpu + i. With dispatched the listen fd
+// is the channel from the master and the loops receive the accepted fds from it instead.
+// Connections idle for timeout_seconds are closed. Does not return
+void run_event_loops(int* listen_fds, int nlisten, int nthreads, int timeout_seconds, int first_cpu,
+                     int dispatched);
+
+#endif
@@ -0,0 +1,173 @@
+// fd_cache.c
+#include "fd_cache.h"
+#include "http.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+
+// One shard: fixed index (sized for its share of the entries) and a list in insertion order.
+// Entries are never refreshed in place, an expired one is replaced by a new open, so the oldest
+// is always at the head and is the one to drop when the shard is full
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    open_file_t** buckets;
+    size_t nbuckets;        // power of 2
+    size_t count;
+    open_file_t* head;
+    open_file_t* tail;
+} fd_shard_t;
+
+static fd_shard_t g_shards[FD_CACHE_SHARDS];
+static size_t g_shard_max;      // entries per shard, 0 = cache off
+static uint64_t g_ttl_ns = 2000000000ULL;
+
+// the TTL is seconds, the coarse clock (a few ms resolution, no syscall) is plenty
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int fd_cache_init(int max_entries, int ttl_seconds) {
+    if (ttl_seconds > 0) g_ttl_ns = (uint64_t)ttl_seconds * 1000000000ULL;
+    if (max_entries < 0) return 0;
+    size_t per_shard = ((size_t)max_entries + FD_CACHE_SHARDS - 1) / FD_CACHE_SHARDS;
+    if (per_shard == 0) per_shard = 1;
+    size_t nb = 16;
+    while (nb < per_shard) nb *= 2;
+    for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+        fd_shard_t* shard = &g_shards[i];
+        shard->buckets = calloc(nb, sizeof(open_file_t*));
+        if (!shard->buckets) {
+            while (--i >= 0) free(g_shards[i].buckets);
+            return -1;
+        }
+        shard->nbuckets = nb;
+        pthread_mutex_init(&shard->lock, NULL);
+    }
+    g_shard_max = per_shard;
+    return 0;
+}
+
+void fd_cache_release(open_file_t* f) {
+    if (!f || atomic_fetch_sub_explicit(&f->refcount, 1, memory_order_acq_rel) != 1) return;
+    if (f->fd >= 0) close(f->fd);
+    free(f->path);
+    free(f);
+}
+
+// open + fstat, a negative entry if there is no regular file to send. *keep is 0 when the open
+// failed for a reason that says nothing about the path (out of fds...), that one is not remembered
+static open_file_t* open_file(const char* path, unsigned long hash, int* keep) {
+    open_file_t* f = calloc(1, sizeof(open_file_t));
+    if (!f) return NULL;
+    f->path = strdup(path);
+    if (!f->path) {
+        free(f);
+        return NULL;
+    }
+    f->hash = hash;
+    f->expires_ns = now_ns() + g_ttl_ns;
+    atomic_init(&f->refcount, 1);
+
+    struct stat st;
+    f->fd = open(path, O_RDONLY | O_CLOEXEC);
+    *keep = f->fd >= 0 || errno == ENOENT || errno == ENOTDIR || errno == EACCES;
+    if (f->fd >= 0 && (fstat(f->fd, &st) != 0 || !S_ISREG(st.st_mode))) { // a directory is not found either
+        close(f->fd);
+        f->fd = -1;
+    }
+    if (f->fd >= 0) {
+        f->size = (size_t)st.st_size;
+        http_file_validators(&st, &f->validators);
+    }
+    return f;
+}
+
+// remove from the index and the list, the cache reference goes with it (lock held)
+static void unlink_entry(fd_shard_t* shard, open_file_t* f) {
+    open_file_t** pp = &shard->buckets[f->hash & (shard->nbuckets - 1)];
+    while (*pp != f) pp = &(*pp)->hnext;
+    *pp = f->hnext;
+    if (f->prev) f->prev->next = f->next;
+    else shard->head = f->next;
+    if (f->next) f->next->prev = f->prev;
+    else shard->tail = f->prev;
+    shard->count--;
+    fd_cache_release(f);
+}
+
+static open_file_t* lookup(fd_shard_t* shard, const char* path, unsigned long hash) {
+    open_file_t* cur = shard->buckets[hash & (shard->nbuckets - 1)];
+    while (cur && !(cur->hash == hash && strcmp(cur->path, path) == 0)) cur = cur->hnext;
+    return cur;
+}
+
+open_file_t* fd_cache_open(const char* path) {
+    unsigned long hash = cache_hash(path);
+    int keep;
+    if (g_shard_max == 0) return open_file(path, hash, &keep);
+
+    fd_shard_t* shard = &g_shards[(hash >> 32) & (FD_CACHE_SHARDS - 1)];
+    pthread_mutex_lock(&shard->lock);
+    open_file_t* f = lookup(shard, path, hash);
+    if (f && f->expires_ns > now_ns()) {
+        atomic_fetch_add_explicit(&f->refcount, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&shard->lock);
+        return f;
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    // the open happens without the lock, two threads may both open the same path: the first one
+    // in keeps its entry, the other just uses its own
+    open_file_t* opened = open_file(path, hash, &keep);
+    if (!opened || !keep) return opened;
+
+    pthread_mutex_lock(&shard->lock);
+    f = lookup(shard, path, hash);
+    if (f && f->expires_ns > now_ns()) {
+        pthread_mutex_unlock(&shard->lock);
+        return opened; // refcount 1, closed after this response
+    }
+    if (f) unlink_entry(shard, f);
+    if (shard->count >= g_shard_max) unlink_entry(shard, shard->head);
+
+    size_t b = hash & (shard->nbuckets - 1);
+    opened->hnext = shard->buckets[b];
+    shard->buckets[b] = opened;
+    opened->prev = shard->tail;
+    opened->next = NULL;
+    if (shard->tail) shard->tail->next = opened;
+    else shard->head = opened;
+    shard->tail = opened;
+    shard->count++;
+    atomic_fetch_add_explicit(&opened->refcount, 1, memory_order_relaxed); // the cache's reference
+    pthread_mutex_unlock(&shard->lock);
+    return opened;
+}
+
+void fd_cache_invalidate(const char* path) {
+    if (g_shard_max == 0) return;
+    unsigned long hash = cache_hash(path);
+    fd_shard_t* shard = &g_shards[(hash >> 32) & (FD_CACHE_SHARDS - 1)];
+    pthread_mutex_lock(&shard->lock);
+    open_file_t* f = lookup(shard, path, hash);
+    if (f) unlink_entry(shard, f);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void fd_cache_invalidate_all(void) {
+    if (g_shard_max == 0) return;
+    for (int i = 0; i < FD_CACHE_SHARDS; i++) {
+        fd_shard_t* shard = &g_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        while (shard->head) unlink_entry(shard, shard->head);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,47 @@
+// fd_cache.h
+#ifndef FD_CACHE_H
+#define FD_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "cache.h"
+
+// Number of independently locked shards (power of 2)
+#define FD_CACHE_SHARDS 8
+
+// What opening a path found, kept for a few seconds (FD_CACHE_TTL_SECONDS) so the next requests
+// for it skip the open and fstat, and a missing path skips the failed open.
+// The fd is shared: readers use pread/sendfile with their own offset, never the file position.
+// refcount = 1 for the cache while the entry is in it + 1 for every response still using the fd,
+// the last one to let go closes it
+typedef struct open_file {
+    char* path;
+    int fd;                     // -1 = negative entry (missing, or not a regular file)
+    size_t size;
+    file_validators_t validators;
+    uint64_t expires_ns;        // monotonic, looked up after this it is opened again
+    atomic_int refcount;
+    unsigned long hash;
+    struct open_file* hnext;    // next in the same hash bucket
+    struct open_file* prev;     // shard list, oldest first (the one dropped when the shard is full)
+    struct open_file* next;
+} open_file_t;
+
+// Per worker (call after fork, the fds are not shared between processes).
+// max_entries < 0 turns it off: every lookup opens the file and the last release closes it
+int fd_cache_init(int max_entries, int ttl_seconds);
+
+// The open file of path, with a reference taken (fd_cache_release it). Check fd for a negative
+// entry. NULL if out of memory
+open_file_t* fd_cache_open(const char* path);
+
+void fd_cache_release(open_file_t* f);
+
+// Forget path (it changed, appeared or went away), the next lookup opens it again
+void fd_cache_invalidate(const char* path);
+
+// Forget every path
+void fd_cache_invalidate_all(void);
+
+#endif
@@ -0,0 +1,149 @@
+// fd_queue.c
+#include "fd_queue.h"
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+static void futex_wait(atomic_uint* addr, unsigned int val) {
+    // returns right away if *addr already changed, so a push between our check and here isnt lost
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint* addr, int n) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+int fd_queue_init(fd_queue_t* q, size_t capacity) {
+    size_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+    // aligned so the ring starts on a cache line boundary
+    q->slots = aligned_alloc(64, ((cap * sizeof(fd_slot_t) + 63) / 64) * 64);
+    if (!q->slots) return -1;
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&q->slots[i].seq, i);
+        q->slots[i].fd = -1;
+    }
+    q->mask = cap - 1;
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->wake_seq, 0);
+    atomic_init(&q->waiters, 0);
+    atomic_init(&q->closed, 0);
+    return 0;
+}
+
+void fd_queue_destroy(fd_queue_t* q) {
+    free(q->slots);
+    q->slots = NULL;
+}
+
+// Wake one sleeping consumer unless a wake is already in flight. The flag is set in the same CAS
+// that sees a sleeper, and every sleeper clears it on its way out, so it can never stay set with
+// nobody left to clear it
+static void wake_one(fd_queue_t* q) {
+    int w = atomic_load(&q->waiters);
+    while (w >= 2 && !(w & 1)) {
+        if (atomic_compare_exchange_weak(&q->waiters, &w, w | 1)) {
+            futex_wake(&q->wake_seq, 1);
+            return;
+        }
+    }
+}
+
+// a consumer stops waiting: one sleeper less, and any pending wake counts as delivered
+static void leave_waiters(fd_queue_t* q) {
+    int w = atomic_load(&q->waiters);
+    while (!atomic_compare_exchange_weak(&q->waiters, &w, (w - 2) & ~1))
+        ;
+}
+
+int fd_queue_push(fd_queue_t* q, int fd, uint64_t stamp) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    fd_slot_t* slot;
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)pos;
+        if (diff == 0) {
+            // slot free at this lap, claim it (on failure pos gets the current tail)
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return -1; // the consumers are a whole lap behind: full
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    slot->fd = fd;
+    slot->stamp = stamp;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release); // readable now
+
+    // seq_cst pairs with the waiters increment in fd_queue_pop: either we see the sleeper or
+    // it sees this fd (or the new wake_seq) before going to sleep
+    atomic_fetch_add(&q->wake_seq, 1);
+    wake_one(q);
+    return 0;
+}
+
+int fd_queue_try_pop(fd_queue_t* q, int* fd, uint64_t* stamp) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    fd_slot_t* slot;
+    while (1) {
+        slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        long diff = (long)seq - (long)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return 0; // nothing written at this position yet: empty
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    *fd = slot->fd;
+    if (stamp) *stamp = slot->stamp;
+    // free for the producers of the next lap
+    atomic_store_explicit(&slot->seq, pos + q->mask + 1, memory_order_release);
+    return 1;
+}
+
+int fd_queue_pop(fd_queue_t* q, uint64_t* stamp) {
+    int fd;
+    while (1) {
+        if (fd_queue_try_pop(q, &fd, stamp)) {
+            // more queued than we can take: pass the wake on to another sleeper
+            if (atomic_load_explicit(&q->tail, memory_order_relaxed) !=
+                atomic_load_explicit(&q->head, memory_order_relaxed))
+                wake_one(q);
+            return fd;
+        }
+        if (atomic_load(&q->closed)) return -1;
+
+        unsigned int seq = atomic_load(&q->wake_seq);
+        atomic_fetch_add(&q->waiters, 2);
+        // check again after announcing ourselves, a push in between would not have woken us
+        if (fd_queue_try_pop(q, &fd, stamp)) {
+            leave_waiters(q);
+            return fd;
+        }
+        if (!atomic_load(&q->closed)) futex_wait(&q->wake_seq, seq);
+        leave_waiters(q);
+    }
+}
+
+size_t fd_queue_length(fd_queue_t* q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+void fd_queue_close(fd_queue_t* q) {
+    atomic_store(&q->closed, 1);
+    atomic_fetch_add(&q->wake_seq, 1);
+    futex_wake(&q->wake_seq, INT_MAX);
+}
@@ -0,0 +1,48 @@
+// fd_queue.h
+#ifndef FD_QUEUE_H
+#define FD_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Bounded multi producer / multi consumer ring of fds (Vyukov's sequence number ring).
+// push and pop are a CAS on head/tail and never lock or allocate. Consumers that find it empty
+// sleep on a futex. Producers only make the wake syscall when someone is sleeping and no other
+// wake is still on its way, a woken consumer that sees more work wakes the next one
+typedef struct fd_slot {
+    atomic_size_t seq;          // tells whether the slot is ready to be written or read at this lap
+    int fd;
+    uint64_t stamp;             // whatever the producer passed (the thread pool: enqueue time)
+} fd_slot_t;
+
+typedef struct fd_queue {
+    fd_slot_t* slots;
+    size_t mask;                // capacity - 1 (capacity is a power of 2)
+    _Alignas(64) atomic_size_t tail;    // next slot to write (producers), own cache line each
+    _Alignas(64) atomic_size_t head;    // next slot to read (consumers)
+    _Alignas(64) atomic_uint wake_seq;  // futex word, bumped on every push
+    atomic_int waiters;         // (consumers in futex_wait or about to be) << 1 | wake in flight
+    atomic_int closed;
+} fd_queue_t;
+
+// capacity is rounded up to a power of 2. Returns 0 or -1 (no memory)
+int fd_queue_init(fd_queue_t* q, size_t capacity);
+void fd_queue_destroy(fd_queue_t* q);
+
+// 0 ok, -1 if the ring is full
+int fd_queue_push(fd_queue_t* q, int fd, uint64_t stamp);
+
+// 1 and *fd (and *stamp if not NULL) set if there was one, 0 if empty
+int fd_queue_try_pop(fd_queue_t* q, int* fd, uint64_t* stamp);
+
+// Waits until there is an fd. Returns -1 once the queue is closed (what is left stays in it)
+int fd_queue_pop(fd_queue_t* q, uint64_t* stamp);
+
+// fds waiting right now (only a snapshot while others push and pop)
+size_t fd_queue_length(fd_queue_t* q);
+
+// Wake every waiting consumer, fd_queue_pop returns -1 from now on
+void fd_queue_close(fd_queue_t* q);
+
+#endif
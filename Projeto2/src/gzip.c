@@ -0,0 +1,81 @@
+// gzip.c
+#include "gzip.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+int gzip_compressible(const char* mime) {
+    return strncmp(mime, "text/", 5) == 0 || strcmp(mime, "application/javascript") == 0;
+}
+
+// q=0, q=0.0, q=0.000 refuse the coding, any other q (or none) takes it
+static int q_is_zero(const char* p, const char* end) {
+    if (p == end || *p != '0') return 0;
+    p++;
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p == '0') p++;
+    }
+    return p == end || *p == ' ' || *p == '\t' || *p == ';' || *p == ',';
+}
+
+int gzip_accepted(const http_slice_t* accept_encoding) {
+    if (!accept_encoding->ptr) return 0; // no header: only identity is safe
+    const char* p = accept_encoding->ptr;
+    const char* end = p + accept_encoding->len;
+    int gzip = -1, star = -1; // -1 not listed, 0 refused, 1 accepted
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        const char* name = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t len = (size_t)(p - name);
+
+        int accepted = 1;
+        while (p < end && *p != ',') { // parameters, only q matters
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ';')) p++;
+            if (end - p >= 2 && (p[0] == 'q' || p[0] == 'Q') && p[1] == '=') accepted = !q_is_zero(p + 2, end);
+            while (p < end && *p != ';' && *p != ',') p++;
+        }
+
+        if ((len == 4 && strncasecmp(name, "gzip", 4) == 0) || (len == 6 && strncasecmp(name, "x-gzip", 6) == 0))
+            gzip = accepted;
+        else if (len == 1 && *name == '*')
+            star = accepted;
+    }
+    return gzip >= 0 ? gzip : star > 0;
+}
+
+unsigned char* gzip_variant(const char* mime, const unsigned char* data, size_t size, size_t* out_size) {
+    if (size < GZIP_MIN_SIZE || size > (size_t)UINT32_MAX || !gzip_compressible(mime)) return NULL;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 15 + 16: the biggest window, wrapped as gzip (header + crc32 trailer) instead of zlib
+    if (deflateInit2(&zs, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return NULL;
+    size_t bound = deflateBound(&zs, (uLong)size);
+    unsigned char* out = malloc(bound);
+    if (!out) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = (uInt)size;
+    zs.next_out = out;
+    zs.avail_out = (uInt)bound;
+    int r = deflate(&zs, Z_FINISH); // the bound is enough for all of it in one call
+    size_t len = zs.total_out;
+    deflateEnd(&zs);
+
+    // not worth a second copy in the cache (and a Vary for clients that gain nothing)
+    if (r != Z_STREAM_END || len > size - size / 8) {
+        free(out);
+        return NULL;
+    }
+    unsigned char* fit = realloc(out, len); // the bound is well above what text compresses to
+    *out_size = len;
+    return fit ? fit : out;
+}
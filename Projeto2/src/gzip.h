@@ -0,0 +1,30 @@
+// gzip.h
+#ifndef GZIP_H
+#define GZIP_H
+
+#include <stddef.h>
+#include "http_parser.h"
+
+// smaller bodies are not worth it, the gzip header and trailer alone are 18 bytes and they fit
+// in one packet either way
+#define GZIP_MIN_SIZE 256
+
+// biggest file a worker compresses on a cache miss, in the middle of serving a request (level 6
+// does roughly 50MB/s, so well under a millisecond). Bigger ones get their variant when the preload
+// or the watcher reads them, off the request path, and are served plain until then
+#define GZIP_INLINE_MAX (32 * 1024)
+
+// zlib level used when a file goes into the cache (once per version of the file, not per request)
+#define GZIP_LEVEL 6
+
+// 1 for the text types get_mime_type returns (html, css, js, txt), images are compressed already
+int gzip_compressible(const char* mime);
+
+// 1 if an Accept-Encoding header takes gzip: "gzip" or "x-gzip" listed, or "*", without q=0
+int gzip_accepted(const http_slice_t* accept_encoding);
+
+// gzip member of data (a file of type mime), malloc'd with its length in *out_size.
+// NULL if the type is not compressible, the file is too small or it didnt get at least 1/8 smaller
+unsigned char* gzip_variant(const char* mime, const unsigned char* data, size_t size, size_t* out_size);
+
+#endif
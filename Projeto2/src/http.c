@@ -1,39 +1,359 @@
+#define _GNU_SOURCE // strptime, timegm
 #include "http.h"
+#include "cache.h"
+#include "error_pages.h"
+#include "fd_cache.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <stdio.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <errno.h>
 
 
-// Simple HTTP request parser: extracts method, path, version from first line
-int parse_http_request(const char* buffer, http_request_t* req) {
-    char* line_end = strstr(buffer, "\r\n");
-    if (!line_end) return -1;
-    char first_line[1024];
-    size_t len = line_end - buffer;
-    if (len >= sizeof(first_line)) return -1;
-    strncpy(first_line, buffer, len);
-    first_line[len] = '\0';
-    if (sscanf(first_line, "%15s %511s %15s", req->method, req->path, req->version) != 3) {
-        return -1;
+static int g_keepalive_timeout = 30;
+static int g_keepalive_max = 100;
+
+// Connection lines, [0] close and [1] keep-alive (the Keep-Alive values only change at start)
+#define CONNECTION_CLOSE "Connection: close\r\n"
+#define CONNECTION_KEEP "Connection: keep-alive\r\nKeep-Alive: timeout=30, max=100\r\n"
+static char g_connection[2][96] = { CONNECTION_CLOSE, CONNECTION_KEEP };
+static size_t g_connection_len[2] = { sizeof(CONNECTION_CLOSE) - 1, sizeof(CONNECTION_KEEP) - 1 };
+
+// Date value, formatted again only when the second changes (like the access log stamp)
+static _Thread_local time_t t_date_sec = -1;
+static _Thread_local char t_date[32];
+
+void http_set_keepalive(int timeout_seconds, int max_requests) {
+    if (timeout_seconds > 0) g_keepalive_timeout = timeout_seconds;
+    if (max_requests > 0) g_keepalive_max = max_requests;
+    int n = snprintf(g_connection[1], sizeof(g_connection[1]), "Connection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n",
+                     g_keepalive_timeout, g_keepalive_max);
+    g_connection_len[1] = (size_t)n < sizeof(g_connection[1]) ? (size_t)n : 0;
+}
+
+size_t http_status_lines(char* out, size_t max, int status, const char* status_msg) {
+    time_t now = time(NULL);
+    if (now != t_date_sec) {
+        struct tm tm_info;
+        gmtime_r(&now, &tm_info);
+        strftime(t_date, sizeof(t_date), "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+        t_date_sec = now;
     }
-    return 0;
+    int n = snprintf(out, max, "HTTP/1.1 %d %s\r\nDate: %s\r\n", status, status_msg, t_date);
+    return (n > 0 && (size_t)n < max) ? (size_t)n : 0;
 }
 
-// Build HTTP response and send
-void send_http_response(int fd, int status, const char* status_msg,
-                       const char* content_type, const char* body, size_t body_len) {
-    char header[2048];
-    int header_len = snprintf(header, sizeof(header),
-        "HTTP/1.1 %d %s\r\n"
+size_t http_render_fields(char* out, size_t max, const char* content_type, size_t content_length, int keep_alive) {
+    int n = snprintf(out, max,
         "Content-Type: %s\r\n"
         "Content-Length: %zu\r\n"
-        "Server: ConcurrentHTTP/1.0\r\n"
-        "Connection: close\r\n"
+        "Server: " HTTP_SERVER "\r\n"
+        "%s"
         "\r\n",
-        status, status_msg, content_type, body_len);
-    send(fd, header, header_len, 0);
-    if (body && body_len > 0) {
-        send(fd, body, body_len, 0);
+        content_type, content_length, g_connection[keep_alive ? 1 : 0]);
+    return (n > 0 && (size_t)n < max) ? (size_t)n : 0;
+}
+
+void http_response_init(http_response_t* resp) {
+    resp->header_len = 0;
+    resp->body = NULL;
+    resp->body_len = 0;
+    resp->file_fd = -1;
+    resp->file = NULL;
+    resp->file_offset = 0;
+    resp->entry = NULL;
+    resp->owned = NULL;
+    resp->errors = NULL;
+    resp->parts = NULL;
+    resp->nparts = 0;
+    resp->sent = 0;
+    resp->keep_alive = 0;
+    resp->started_ns = 0;
+    trace_reset(&resp->trace);
+    resp->status = 0;
+    resp->stats_bytes = 0;
+    resp->log_bytes = 0;
+    resp->method[0] = '\0';
+    resp->path[0] = '\0';
+}
+
+void http_response_free(http_response_t* resp) {
+    cache_release(resp->entry); // the entry can be evicted for real now
+    free(resp->owned);
+    error_pages_release(resp->errors);
+    free(resp->parts);
+    if (resp->file) fd_cache_release(resp->file); // the fd is closed by its last user
+    else if (resp->file_fd >= 0) close(resp->file_fd);
+    http_response_init(resp);
+}
+
+// Build HTTP response headers
+void http_response_set_header(http_response_t* resp, int status, const char* status_msg,
+                              const char* content_type, size_t content_length, int keep_alive) {
+    size_t at = http_status_lines(resp->header, sizeof(resp->header), status, status_msg);
+    size_t n = http_render_fields(resp->header + at, sizeof(resp->header) - at, content_type, content_length, keep_alive);
+    resp->header_len = (at > 0 && n > 0) ? at + n : 0;
+    resp->keep_alive = keep_alive;
+    resp->status = status;
+}
+
+int http_response_set_rendered(http_response_t* resp, int status, const char* status_msg,
+                               const char* fields, size_t fields_len, int keep_alive) {
+    size_t at = http_status_lines(resp->header, sizeof(resp->header), status, status_msg);
+    const char* connection = g_connection[keep_alive ? 1 : 0];
+    size_t connection_len = g_connection_len[keep_alive ? 1 : 0];
+    if (at == 0 || at + fields_len + connection_len + 2 > sizeof(resp->header)) return -1;
+    memcpy(resp->header + at, fields, fields_len);
+    at += fields_len;
+    memcpy(resp->header + at, connection, connection_len);
+    at += connection_len;
+    memcpy(resp->header + at, "\r\n", 2);
+    resp->header_len = at + 2;
+    resp->keep_alive = keep_alive;
+    resp->status = status;
+    return 0;
+}
+
+int http_response_add_header(http_response_t* resp, const char* name, const char* value) {
+    if (resp->header_len < 2) return -1;
+    size_t at = resp->header_len - 2; // over the blank line, which goes back at the end
+    int n = snprintf(resp->header + at, sizeof(resp->header) - at, "%s: %s\r\n\r\n", name, value);
+    if (n < 0 || at + (size_t)n >= sizeof(resp->header)) {
+        memcpy(resp->header + at, "\r\n", 2);
+        return -1;
+    }
+    resp->header_len = at + (size_t)n;
+    return 0;
+}
+
+void http_file_validators(const struct stat* st, file_validators_t* v) {
+    // a file rewritten within the same second usually changes size, the nanoseconds catch the rest
+    unsigned long long mtime_ns = (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL + (unsigned long long)st->st_mtim.tv_nsec;
+    snprintf(v->etag, sizeof(v->etag), "\"%llx-%llx-%llx\"", (unsigned long long)st->st_ino,
+             (unsigned long long)st->st_size, mtime_ns);
+    v->mtime = st->st_mtim.tv_sec;
+    struct tm tm_info;
+    gmtime_r(&v->mtime, &tm_info);
+    strftime(v->last_modified, sizeof(v->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+}
+
+// If-None-Match is "*" or a list of (maybe weak, W/"...") tags, compared ignoring the W/
+static int etag_listed(const http_slice_t* list, const char* etag) {
+    size_t elen = strlen(etag);
+    const char* p = list->ptr;
+    const char* end = p + list->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        if (*p == '*') return 1;
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') p += 2;
+        const char* tag = p;
+        if (p < end && *p == '"') {
+            p++;
+            while (p < end && *p != '"') p++;
+            if (p < end) p++;
+        } else {
+            while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+        }
+        if ((size_t)(p - tag) == elen && memcmp(tag, etag, elen) == 0) return 1;
+    }
+    return 0;
+}
+
+int http_not_modified(const http_request_t* req, const file_validators_t* v) {
+    if (v->etag[0] == '\0') return 0; // nothing to compare with
+    // If-None-Match wins, If-Modified-Since is only looked at without it (RFC 7232 section 6)
+    if (req->if_none_match.ptr) return etag_listed(&req->if_none_match, v->etag);
+    if (!req->if_modified_since.ptr) return 0;
+    // browsers send back exactly the Last-Modified they got
+    if (strcmp(req->if_modified_since.ptr, v->last_modified) == 0) return 1;
+    struct tm tm_info;
+    memset(&tm_info, 0, sizeof(tm_info));
+    const char* rest = strptime(req->if_modified_since.ptr, "%a, %d %b %Y %H:%M:%S GMT", &tm_info);
+    if (!rest || *rest != '\0') return 0; // not a date we understand: ignore the header
+    return v->mtime <= timegm(&tm_info);
+}
+
+// digits of a range bound, saturating (a bound past any file just means "to the end"/"nothing")
+static const char* parse_bound(const char* p, const char* end, size_t* out, int* found) {
+    size_t v = 0;
+    *found = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        size_t d = (size_t)(*p - '0');
+        v = v > (SIZE_MAX - d) / 10 ? SIZE_MAX : v * 10 + d;
+        *found = 1;
+        p++;
+    }
+    *out = v;
+    return p;
+}
+
+int http_parse_ranges(const http_slice_t* header, size_t size, http_range_t* out, int max) {
+    const char* p = header->ptr;
+    const char* end = p + header->len;
+    if (header->len < 6 || strncasecmp(p, "bytes=", 6) != 0) return -1;
+    p += 6;
+
+    int n = 0, seen = 0;
+    size_t total = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) break;
+        size_t first = 0, last = 0;
+        int has_first, has_last;
+        p = parse_bound(p, end, &first, &has_first);
+        if (p == end || *p != '-') return -1;
+        p = parse_bound(p + 1, end, &last, &has_last);
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') return -1;
+        if (!has_first && !has_last) return -1;
+        if (has_first && has_last && last < first) return -1;
+        seen++;
+
+        size_t start, len;
+        if (!has_first) { // "-500" = the last 500 bytes
+            if (last == 0 || size == 0) continue;
+            len = last < size ? last : size;
+            start = size - len;
+        } else { // "100-199" or "100-"
+            if (first >= size) continue;
+            start = first;
+            len = (has_last && last < size ? last + 1 : size) - first;
+        }
+        if (n == max) return -1;
+        total += len;
+        if (total > size) return -1; // overlapping ranges, not worth sending the same bytes again
+        out[n].start = start;
+        out[n].len = len;
+        n++;
+    }
+    return seen ? n : -1;
+}
+
+int http_response_set_ranges(http_response_t* resp, const http_range_t* ranges, int nranges,
+                             const char* content_type, size_t size, int keep_alive) {
+    char value[96];
+    if (nranges == 1) {
+        http_response_set_header(resp, 206, "Partial Content", content_type, ranges[0].len, keep_alive);
+        snprintf(value, sizeof(value), "bytes %zu-%zu/%zu", ranges[0].start, ranges[0].start + ranges[0].len - 1, size);
+        http_response_add_header(resp, "Content-Range", value);
+        if (resp->file_fd >= 0) resp->file_offset += (off_t)ranges[0].start;
+        else resp->body += ranges[0].start;
+        resp->body_len = ranges[0].len;
+        return 0;
+    }
+
+    // one block: the part table, then the text of the part headers it points to
+    char boundary[24];
+    static _Atomic unsigned long counter;
+    snprintf(boundary, sizeof(boundary), "%016lx", (unsigned long)time(NULL) * 2654435761UL + ++counter);
+    size_t type_len = strlen(content_type);
+    size_t head_max = 192 + type_len; // 3 numbers of at most 20 digits and ~70 bytes of text
+    http_part_t* parts = malloc((size_t)(nranges + 1) * (sizeof(http_part_t) + head_max));
+    if (!parts) return -1;
+    char* text = (char*)(parts + nranges + 1);
+
+    size_t body_len = 0;
+    for (int i = 0; i <= nranges; i++) {
+        int n;
+        if (i < nranges)
+            n = snprintf(text, head_max, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                         boundary, content_type, ranges[i].start, ranges[i].start + ranges[i].len - 1, size);
+        else
+            n = snprintf(text, head_max, "\r\n--%s--\r\n", boundary);
+        parts[i].head = text;
+        parts[i].head_len = (size_t)n;
+        parts[i].start = i < nranges ? ranges[i].start : 0;
+        parts[i].len = i < nranges ? ranges[i].len : 0;
+        body_len += parts[i].head_len + parts[i].len;
+        text += n;
     }
-}
\ No newline at end of file
+
+    snprintf(value, sizeof(value), "multipart/byteranges; boundary=%s", boundary);
+    http_response_set_header(resp, 206, "Partial Content", value, body_len, keep_alive);
+    resp->parts = parts;
+    resp->nparts = nranges + 1;
+    resp->body_len = body_len;
+    return 0;
+}
+
+// len bytes of the body from at: memory, or the file when *mem is NULL
+static size_t body_piece(const http_response_t* resp, size_t at, size_t len, const char** mem, off_t* file_offset) {
+    if (resp->file_fd >= 0) {
+        *mem = NULL;
+        *file_offset = resp->file_offset + (off_t)at;
+    } else {
+        *mem = resp->body + at;
+    }
+    return len;
+}
+
+// What comes at byte pos of the response (header included): memory (*mem) or the file (*mem NULL,
+// *file_offset). Returns how many bytes of that piece are left, 0 past the end
+static size_t piece_at(const http_response_t* resp, size_t pos, const char** mem, off_t* file_offset) {
+    if (pos < resp->header_len) {
+        *mem = resp->header + pos;
+        return resp->header_len - pos;
+    }
+    pos -= resp->header_len;
+    if (pos >= resp->body_len) return 0; // the end, or a HEAD (body_len 0)
+    if (resp->nparts == 0) return body_piece(resp, pos, resp->body_len - pos, mem, file_offset);
+    for (int i = 0; i < resp->nparts; i++) {
+        const http_part_t* part = &resp->parts[i];
+        if (pos < part->head_len) {
+            *mem = part->head + pos;
+            return part->head_len - pos;
+        }
+        pos -= part->head_len;
+        if (pos < part->len) return body_piece(resp, part->start + pos, part->len - pos, mem, file_offset);
+        pos -= part->len;
+    }
+    return 0;
+}
+
+int http_response_write(int fd, http_response_t* resp) {
+    size_t total = resp->header_len + resp->body_len;
+    while (resp->sent < total) {
+        ssize_t n;
+        const char* mem;
+        off_t offset = 0;
+        size_t len = piece_at(resp, resp->sent, &mem, &offset);
+        if (mem) {
+            // header, part headers and memory body go together in one call
+            struct iovec iov[16];
+            int cnt = 0;
+            size_t pos = resp->sent;
+            while (len > 0 && mem && cnt < 16) {
+                iov[cnt].iov_base = (void*)mem;
+                iov[cnt].iov_len = len;
+                cnt++;
+                pos += len;
+                len = piece_at(resp, pos, &mem, &offset);
+            }
+            // more to come right after (a file, or past the 16 pieces): dont push a partial segment
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)cnt };
+            n = sendmsg(fd, &msg, len > 0 ? MSG_MORE : 0);
+        } else {
+            // file body: the kernel copies it from the page cache, sendfile can stop early so
+            // we continue from where it stopped (at most ~1GB per call)
+            if (len > (1UL << 30)) len = 1UL << 30;
+            n = sendfile(fd, resp->file_fd, &offset, len);
+            if (n == 0) return -1; // file got shorter than its fstat size
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1; // client went away
+        }
+        resp->sent += (size_t)n;
+    }
+    return 1;
+}
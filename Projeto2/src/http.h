@@ -2,19 +2,119 @@
 #define HTTP_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "trace.h"
+#include "http_parser.h"
 
-// Parsed HTTP request structure
+struct cache_entry;
+struct error_pages;
+struct open_file;
+struct file_validators;
+struct stat;
+
+#define HTTP_SERVER "ConcurrentHTTP/1.0"
+
+// Values announced in the Keep-Alive header (TIMEOUT_SECONDS and KEEPALIVE_MAX_REQUESTS)
+void http_set_keepalive(int timeout_seconds, int max_requests);
+
+// Status line and Date, the part of a response header that is never the same twice. Returns the
+// length, 0 if it didnt fit in max
+size_t http_status_lines(char* out, size_t max, int status, const char* status_msg);
+
+// The rest of a basic header (Content-Type, Content-Length, Server, Connection and the blank line),
+// which can be rendered once and reused (error pages). Returns the length, 0 if it didnt fit
+size_t http_render_fields(char* out, size_t max, const char* content_type, size_t content_length, int keep_alive);
+
+// most ranges one request can ask for, more (or more bytes than the file) get the whole file
+#define HTTP_MAX_RANGES 16
+
+// bytes [start, start + len) of the body
+typedef struct {
+    size_t start;
+    size_t len;
+} http_range_t;
+
+// One part of a multipart/byteranges body: its boundary and headers, then a range of the body
 typedef struct {
+    const char* head;
+    size_t head_len;
+    size_t start;
+    size_t len;
+} http_part_t;
+
+// A response ready to be written: headers plus a body that is either in memory (cache entry,
+// malloc'd buffer, pre-rendered error page or constant text) or a range of an open file sent with sendfile().
+// With parts the body is instead several ranges of that memory/file, each after its own part
+// header (multipart/byteranges).
+// Writing can stop when the socket is full and be resumed later (sent keeps the progress),
+// so the same response works for blocking and non blocking sockets
+typedef struct http_response {
+    char header[1024];
+    size_t header_len;
+    const char* body;           // memory body (NULL when there is a file body or no body)
+    size_t body_len;            // bytes of body to send (0 for HEAD)
+    int file_fd;                // file body, -1 if none (closed when the response is freed, unless
+                                // it belongs to file)
+    struct open_file* file;     // fd cache reference the file_fd comes from, released when the response is freed
+    off_t file_offset;
+    struct cache_entry* entry;  // cache reference released when the response is freed
+    char* owned;                // malloc'd body freed when the response is freed
+    struct error_pages* errors; // error page set reference released when the response is freed
+    http_part_t* parts;         // multipart body (malloc'd with the part headers, freed with the response)
+    int nparts;                 // the last one is the closing boundary (len 0)
+    size_t sent;                // bytes of header+body already written
+    int keep_alive;
+    uint64_t started_ns;        // when the request was complete (monotonic), for the latency histogram
+    request_trace_t trace;      // phase timing (TRACE_REQUESTS=1), from its first byte
+    // filled by whoever builds it, used for stats and the access log once it is sent
+    int status;
+    size_t stats_bytes;
+    size_t log_bytes;
     char method[16];
     char path[512];
-    char version[16];
-} http_request_t;
+} http_response_t;
+
+void http_response_init(http_response_t* resp);
+
+// Release whatever the body holds (cache reference, buffer, file) and reset it
+void http_response_free(http_response_t* resp);
+
+// Status line and headers, keep_alive picks "Connection: keep-alive" or "Connection: close".
+// content_length can differ from the body sent (HEAD)
+void http_response_set_header(http_response_t* resp, int status, const char* status_msg,
+                              const char* content_type, size_t content_length, int keep_alive);
+
+// Status line, Date, then fields (header lines rendered ahead of time, each ending in "\r\n", no
+// Connection) and the Connection lines: a whole header without formatting anything but the status.
+// -1 (and nothing set) if it doesnt fit in resp->header
+int http_response_set_rendered(http_response_t* resp, int status, const char* status_msg,
+                               const char* fields, size_t fields_len, int keep_alive);
+
+// Add one more header line after the ones http_response_set_header wrote, -1 if it doesnt fit
+int http_response_add_header(http_response_t* resp, const char* name, const char* value);
+
+// Byte ranges of a body of size bytes asked for by a Range header. Returns the number of ranges,
+// 0 if none of them is inside the body (416) or -1 if the header should be ignored (not bytes=,
+// malformed, too many ranges or more bytes than the whole body: send all of it)
+int http_parse_ranges(const http_slice_t* header, size_t size, http_range_t* out, int max);
+
+// Turn a response whose body is already set (memory or file, the whole thing) into a 206 for
+// these ranges of it: one range is sent as it is, more as multipart/byteranges.
+// Returns -1 if there was no memory for the part headers
+int http_response_set_ranges(http_response_t* resp, const http_range_t* ranges, int nranges,
+                             const char* content_type, size_t size, int keep_alive);
+
+// ETag (inode, size and mtime) and Last-Modified of a file
+void http_file_validators(const struct stat* st, struct file_validators* v);
 
-// Parse raw HTTP request buffer into http_request_t
-int parse_http_request(const char* buffer, http_request_t* req);
+// 1 if If-None-Match / If-Modified-Since say the client copy is still the current one (send a 304)
+int http_not_modified(const http_request_t* req, const struct file_validators* v);
 
-// HTTP response builder and sender
-void send_http_response(int fd, int status, const char* status_msg,
-                       const char* content_type, const char* body, size_t body_len);
+// Write as much as the socket takes: the memory pieces in one sendmsg, MSG_MORE on it when a file
+// body follows so the header and the first bytes of the file share a segment. Returns 1 when
+// everything was sent, 0 if the socket would block (try again when it is writable, a short write
+// continues from resp->sent) and -1 if the client went away
+int http_response_write(int fd, http_response_t* resp);
 
-#endif
\ No newline at end of file
+#endif
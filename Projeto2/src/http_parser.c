@@ -0,0 +1,197 @@
+// http_parser.c
+#include "http_parser.h"
+#include <string.h>
+#include <strings.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// tchar of RFC 7230, what a header name can be made of
+static const unsigned char token_chars[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 1, 1, 1, 1, 1, 0, 0, 1, 1, 0, 1, 1, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+    0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 1, 0, 1, 0,
+};
+
+typedef const char* (*find_lf_fn)(const char* buf, const char* p, const char* end);
+
+// Each one returns the first '\n' in [p, end), or end if there is none. buf is where the buffer
+// starts: the last compare is done on the 16/32 bytes that end at end (overlapping what was
+// already looked at) instead of going byte by byte, it never reads outside [buf, end)
+static const char* find_lf_bytes(const char* buf, const char* p, const char* end) {
+    (void)buf;
+    while (p < end && *p != '\n') p++;
+    return p;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static const char* find_lf_sse2(const char* buf, const char* p, const char* end) {
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), lf));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    if (p == end || end - buf < 16) return find_lf_bytes(buf, p, end);
+    const char* last = end - 16;
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)last), lf));
+    mask >>= (p - last); // drop the bytes before p
+    return mask ? p + __builtin_ctz(mask) : end;
+}
+
+__attribute__((target("avx2")))
+static const char* find_lf_avx2(const char* buf, const char* p, const char* end) {
+    const __m256i lf = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), lf));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+    if (p == end || end - buf < 32) return find_lf_sse2(buf, p, end);
+    const char* last = end - 32;
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)last), lf));
+    mask >>= (p - last);
+    return mask ? p + __builtin_ctz(mask) : end;
+}
+#endif
+
+static _Atomic(find_lf_fn) g_find_lf; // NULL until the first parse picks one
+
+int http_parser_set_simd(int level) {
+    find_lf_fn fn = find_lf_bytes;
+    int used = 0;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (level >= 2 && __builtin_cpu_supports("avx2")) {
+        fn = find_lf_avx2;
+        used = 2;
+    } else if (level >= 1 && __builtin_cpu_supports("sse2")) {
+        fn = find_lf_sse2;
+        used = 1;
+    }
+#else
+    (void)level;
+#endif
+    atomic_store_explicit(&g_find_lf, fn, memory_order_relaxed);
+    return used;
+}
+
+void http_parser_reset(http_parser_t* p) {
+    memset(p, 0, sizeof(*p));
+}
+
+static void set_slice(http_slice_t* s, char* ptr, size_t len) {
+    ptr[len] = '\0'; // the separator after it, already scanned
+    s->ptr = ptr;
+    s->len = len;
+}
+
+// "GET /path HTTP/1.1", exactly one space between the three
+static int parse_request_line(http_request_t* req, char* line, size_t len) {
+    char* sp1 = memchr(line, ' ', len);
+    if (!sp1 || sp1 == line) return -1;
+    char* path = sp1 + 1;
+    char* sp2 = memchr(path, ' ', len - (size_t)(path - line));
+    if (!sp2 || sp2 == path) return -1;
+    char* version = sp2 + 1;
+    size_t vlen = len - (size_t)(version - line);
+    if (vlen != 8 || memcmp(version, "HTTP/1.", 7) != 0 || version[7] < '0' || version[7] > '9') return -1;
+
+    set_slice(&req->method, line, (size_t)(sp1 - line));
+    set_slice(&req->path, path, (size_t)(sp2 - path));
+    set_slice(&req->version, version, vlen);
+    // HTTP/1.1 keeps the connection unless told otherwise, HTTP/1.0 only if it asks for it
+    req->keep_alive = (version[7] >= '1');
+    return 0;
+}
+
+// the headers build_response looks at, NULL for the ones it ignores
+static http_slice_t* header_slot(http_request_t* req, const char* name, size_t len) {
+    char first = (char)(name[0] | 0x20); // lower case letter, saves the strncasecmp for most of the others
+    if (first != 'h' && first != 'r' && first != 'c' && first != 'i' && first != 'a') return NULL;
+    switch (len) {
+    case 4: return strncasecmp(name, "Host", 4) == 0 ? &req->host : NULL;
+    case 5: return strncasecmp(name, "Range", 5) == 0 ? &req->range : NULL;
+    case 8: return strncasecmp(name, "If-Range", 8) == 0 ? &req->if_range : NULL;
+    case 10: return strncasecmp(name, "Connection", 10) == 0 ? &req->connection : NULL;
+    case 13: return strncasecmp(name, "If-None-Match", 13) == 0 ? &req->if_none_match : NULL;
+    case 15: return strncasecmp(name, "Accept-Encoding", 15) == 0 ? &req->accept_encoding : NULL;
+    case 17: return strncasecmp(name, "If-Modified-Since", 17) == 0 ? &req->if_modified_since : NULL;
+    }
+    return NULL;
+}
+
+// "Name: value", no space before the colon and no folded lines (both are a 400 in RFC 7230)
+static int parse_header_line(http_request_t* req, char* line, size_t len) {
+    char* colon = line;
+    while (colon < line + len && token_chars[(unsigned char)*colon]) colon++;
+    if (colon == line || colon == line + len || *colon != ':') return -1;
+
+    http_slice_t* slot = header_slot(req, line, (size_t)(colon - line));
+    if (!slot) return 0;
+    if (slot->ptr) return slot == &req->host ? -1 : 0; // two Host headers is an error, otherwise the first wins
+
+    char* value = colon + 1;
+    char* end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    set_slice(slot, value, (size_t)(end - value));
+    return 0;
+}
+
+// Connection is a list ("keep-alive, Upgrade"), close wins over keep-alive
+static void apply_connection(http_request_t* req) {
+    const char* v = req->connection.ptr;
+    const char* end = v + req->connection.len;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) v++;
+        const char* t = v;
+        while (v < end && *v != ',' && *v != ' ' && *v != '\t') v++;
+        size_t n = (size_t)(v - t);
+        if (n == 5 && strncasecmp(t, "close", 5) == 0) {
+            req->keep_alive = 0;
+            return;
+        }
+        if (n == 10 && strncasecmp(t, "keep-alive", 10) == 0) req->keep_alive = 1;
+    }
+}
+
+int http_parser_run(http_parser_t* p, char* buf, size_t len) {
+    find_lf_fn find_lf = atomic_load_explicit(&g_find_lf, memory_order_relaxed);
+    if (!find_lf) {
+        http_parser_set_simd(2);
+        find_lf = atomic_load_explicit(&g_find_lf, memory_order_relaxed);
+    }
+
+    const char* end = buf + len;
+    while (p->pos < len) {
+        char* lf = (char*)find_lf(buf, buf + p->pos, end);
+        if (lf == end) {
+            p->pos = len; // no line end yet, next time continue from here
+            return HTTP_PARSE_AGAIN;
+        }
+        char* line = buf + p->line_start;
+        size_t line_len = (size_t)(lf - line);
+        if (line_len > 0 && line[line_len - 1] == '\r') line_len--; // CRLF, a bare LF works too
+        p->pos = (size_t)(lf - buf) + 1;
+        p->line_start = p->pos;
+
+        if (!p->in_headers) {
+            if (line_len == 0) continue; // blank lines before the request line are allowed
+            if (parse_request_line(&p->req, line, line_len) != 0) return HTTP_PARSE_ERROR;
+            p->in_headers = 1;
+        } else if (line_len == 0) {
+            if (p->req.connection.ptr) apply_connection(&p->req);
+            p->req.header_len = p->pos;
+            return HTTP_PARSE_DONE;
+        } else if (parse_header_line(&p->req, line, line_len) != 0) {
+            return HTTP_PARSE_ERROR;
+        }
+    }
+    return HTTP_PARSE_AGAIN;
+}
@@ -0,0 +1,54 @@
+// http_parser.h
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+
+// A piece of the receive buffer (no copy). The parser overwrites the byte after it (space, CR or LF)
+// with '\0', so ptr can also be used as a C string. ptr is NULL if the header was not there
+typedef struct {
+    const char* ptr;
+    size_t len;
+} http_slice_t;
+
+// Parsed HTTP request, everything points into the buffer the parser ran on
+typedef struct {
+    http_slice_t method;
+    http_slice_t path;
+    http_slice_t version;
+    http_slice_t host;
+    http_slice_t connection;
+    http_slice_t range;
+    http_slice_t if_range;
+    http_slice_t if_none_match;
+    http_slice_t if_modified_since;
+    http_slice_t accept_encoding;
+    int keep_alive;     // client wants the connection open after the response (HTTP/1.1 default, Connection header)
+    size_t header_len;  // bytes from the start of the buffer to the end of the blank line
+} http_request_t;
+
+#define HTTP_PARSE_ERROR (-1)
+#define HTTP_PARSE_AGAIN 0
+#define HTTP_PARSE_DONE 1
+
+// Resumable: every call continues from where the last one stopped, so a header that comes in
+// many reads is looked at once in total instead of from the start on every read
+typedef struct {
+    size_t pos;         // bytes already scanned
+    size_t line_start;  // start of the line being scanned
+    int in_headers;     // request line done
+    http_request_t req;
+} http_parser_t;
+
+void http_parser_reset(http_parser_t* p);
+
+// Parse buf[0..len) (the same buffer as before, with more bytes at the end). HTTP_PARSE_DONE once
+// the blank line after the headers is there (p->req is ready), HTTP_PARSE_AGAIN if more bytes are
+// needed and HTTP_PARSE_ERROR for something that is not an HTTP/1.x request header
+int http_parser_run(http_parser_t* p, char* buf, size_t len);
+
+// Line end scanning: 0 byte loop, 1 SSE2, 2 AVX2 (asking for more than the cpu has gives less).
+// Picked from the cpu on the first parse, this is for the benchmark. Returns the one in use
+int http_parser_set_simd(int level);
+
+#endif
@@ -2,51 +2,303 @@
 #include "logger.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <semaphore.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
-#define LOG_FILE "access.log"
-#define LOG_MAX_SIZE (10*1024) // 10MB
+#define LOG_LINE_MAX 1024
+#define LOG_MAX_IOV 64
 
-// Helper: rotate log file if exceeds 10MB
-static void rotate_log_file(FILE* fp, struct tm* tm_info) {
-    if (!fp){
-        fprintf(stderr, "Log file pointer is NULL\n");
+// Single producer (its thread) single consumer (the flusher) byte ring of finished lines.
+// head and tail only grow, position in data is (x & (size - 1))
+typedef struct log_ring {
+    _Alignas(64) atomic_size_t head;    // written by the owner thread
+    _Alignas(64) atomic_size_t tail;    // written by the flusher
+    atomic_ulong dropped;               // lines that didnt fit
+    size_t size;                        // power of two
+    int to_stderr;                      // message ring (log_message) instead of access log lines
+    struct log_ring* next;              // every ring of the process (never removed, threads live as long as it)
+    char data[];
+} log_ring_t;
+
+static _Atomic(log_ring_t*) g_rings;
+static _Thread_local log_ring_t* t_ring;
+static _Thread_local log_ring_t* t_msg_ring;
+static atomic_int g_started;            // the flusher is running, messages can go to the rings
+static _Thread_local time_t t_stamp_sec = -1;
+static _Thread_local char t_stamp[64];
+
+static char g_path[256];
+static sem_t* g_rotate_sem;
+static int g_fd = -1;                   // only set before g_started or under g_flush_mutex
+static pthread_mutex_t g_flush_mutex = PTHREAD_MUTEX_INITIALIZER; // flusher vs logger_flush
+static sigset_t g_stop_signals;
+
+static log_ring_t* ring_create(size_t size, int to_stderr) {
+    log_ring_t* r = aligned_alloc(64, sizeof(log_ring_t) + size);
+    if (!r) return NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->dropped, 0);
+    r->size = size;
+    r->to_stderr = to_stderr;
+    // push on the list, the flusher may be walking it
+    log_ring_t* first = atomic_load_explicit(&g_rings, memory_order_relaxed);
+    do {
+        r->next = first;
+    } while (!atomic_compare_exchange_weak_explicit(&g_rings, &first, r, memory_order_release, memory_order_relaxed));
+    return r;
+}
+
+static void ring_put(log_ring_t* r, const char* line, size_t len) {
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (r->size - (head - tail) < len) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
         return;
-    } 
-    fseek(fp, 0, SEEK_END); //go to end
-    long size = ftell(fp); //get size since we are at the end
-    if (size >= LOG_MAX_SIZE) {
-        fclose(fp);
-        char rotated_name[128];
-        strftime(rotated_name, sizeof(rotated_name), //create a new name appending timestamp consult time.h library
-                 "access_%Y%m%d%H%M%S.log", tm_info); //decided to do it this way se we did this in the first project too (restore function)
-        rename(LOG_FILE, rotated_name);
-       
     }
+    size_t pos = head & (r->size - 1);
+    size_t first = r->size - pos < len ? r->size - pos : len;
+    memcpy(r->data + pos, line, first);
+    memcpy(r->data, line + first, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+}
+
+// snprintf result -> length of the line in the buffer, cut but still ending in a newline
+static size_t line_length(char* line, int len) {
+    if (len < 0) return 0;
+    if ((size_t)len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX - 1;
+        line[len - 1] = '\n';
+    }
+    return (size_t)len;
 }
 
-// Thread/process safe logging
-void log_request(sem_t* log_sem, const char* client_ip, const char* method,
+void log_request(const char* client_ip, const char* method,
                  const char* path, int status, size_t bytes) {
+    // not g_fd: the flusher reopens it on rotation, only it (under g_flush_mutex) touches the fd
+    if (!atomic_load_explicit(&g_started, memory_order_acquire)) return;
+    log_ring_t* r = t_ring ? t_ring : (t_ring = ring_create(LOG_RING_SIZE, 0));
+    if (!r) return;
+
+    // localtime_r + strftime once a second per thread, not per line
     time_t now = time(NULL);
-    struct tm* tm_info = localtime(&now);
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%d/%b/%Y:%H:%M:%S %z", tm_info);
-
-    sem_wait(log_sem);
-    FILE* log = fopen(LOG_FILE, "a");
-    if (log) {
-        rotate_log_file(log, tm_info); //check if we need to rotate
-        log = fopen(LOG_FILE, "a");
-        if (log) {
-            fprintf(log, "%s - - [%s] \"%s %s HTTP/1.1\" %d %zu\n",
-                client_ip, timestamp, method, path, status, bytes);
-            fclose(log);
+    if (now != t_stamp_sec) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        strftime(t_stamp, sizeof(t_stamp), "%d/%b/%Y:%H:%M:%S %z", &tm_info);
+        t_stamp_sec = now;
+    }
+
+    char line[LOG_LINE_MAX];
+    size_t len = line_length(line, snprintf(line, sizeof(line), "%s - - [%s] \"%s %s HTTP/1.1\" %d %zu\n",
+                                            client_ip, t_stamp, method, path, status, bytes));
+    if (len > 0) ring_put(r, line, len);
+}
+
+void log_message(int level, const char* fmt, ...) {
+    static const char* level_names[] = { "?", "ERROR", "WARN", "INFO", "DEBUG" };
+    int saved_errno = errno;
+    char line[LOG_LINE_MAX];
+    int prefix = snprintf(line, sizeof(line), "[%s] ", level_names[level >= 1 && level <= 4 ? level : 0]);
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line + prefix, sizeof(line) - (size_t)prefix - 1, fmt, ap);
+    va_end(ap);
+    if (len < 0) len = 0;
+    len += prefix;
+    if ((size_t)len > sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+
+    if (!atomic_load_explicit(&g_started, memory_order_acquire)) {
+        ssize_t ignored = write(STDERR_FILENO, line, (size_t)len);
+        (void)ignored;
+    } else {
+        log_ring_t* r = t_msg_ring ? t_msg_ring : (t_msg_ring = ring_create(LOG_MSG_RING_SIZE, 1));
+        if (r) ring_put(r, line, (size_t)len);
+    }
+    errno = saved_errno; // LOG_ERROR("...: %s", strerror(errno)) and then look at errno again
+}
+
+static int open_log(void) {
+    int fd = open(g_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("open log file");
+        return -1;
+    }
+    if (g_fd >= 0) close(g_fd);
+    g_fd = fd;
+    return 0;
+}
+
+// access.log -> access_20250101120000.log (same directory)
+static void rotated_name(char* out, size_t size) {
+    char stamp[32];
+    time_t now = time(NULL);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm_info);
+
+    const char* slash = strrchr(g_path, '/');
+    const char* dot = strrchr(g_path, '.');
+    if (!dot || (slash && dot < slash)) {
+        snprintf(out, size, "%s_%s", g_path, stamp);
+        return;
+    }
+    snprintf(out, size, "%.*s_%s%s", (int)(dot - g_path), g_path, stamp, dot);
+}
+
+// Every worker appends to the same file: whoever sees it past LOG_MAX_SIZE renames it (once, under
+// the semaphore), everyone notices the name now points to another file and reopens
+static void check_rotation(void) {
+    struct stat mine, current;
+    if (fstat(g_fd, &mine) != 0) return;
+    if (mine.st_size >= LOG_MAX_SIZE) {
+        if (g_rotate_sem) sem_wait(g_rotate_sem);
+        if (stat(g_path, &current) == 0 && current.st_ino == mine.st_ino && current.st_dev == mine.st_dev) {
+            char rotated[300];
+            rotated_name(rotated, sizeof(rotated));
+            rename(g_path, rotated); //decided to do it this way se we did this in the first project too (restore function)
         }
+        if (g_rotate_sem) sem_post(g_rotate_sem);
+        open_log();
+    } else if (stat(g_path, &current) != 0 || current.st_ino != mine.st_ino || current.st_dev != mine.st_dev) {
+        open_log(); // another worker rotated it (or it was removed)
     }
-    sem_post(log_sem);
-}
\ No newline at end of file
+}
+
+static void write_all(int fd, struct iovec* iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write log file");
+            return; // disk full or similar, lose this batch rather than block the rings forever
+        }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+}
+
+// One writev for (up to LOG_MAX_IOV pieces of) every ring of one kind, then hand the space back.
+// Returns the lines those rings dropped since the last time
+static unsigned long drain_rings(int to_stderr, int fd) {
+    struct iovec iov[LOG_MAX_IOV];
+    log_ring_t* rings[LOG_MAX_IOV / 2];
+    size_t heads[LOG_MAX_IOV / 2];
+    int cnt = 0, nrings = 0;
+    unsigned long dropped = 0;
+
+    for (log_ring_t* r = atomic_load_explicit(&g_rings, memory_order_acquire); r; r = r->next) {
+        if (r->to_stderr != to_stderr) continue;
+        dropped += atomic_exchange_explicit(&r->dropped, 0, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        if (head == tail) continue;
+
+        size_t pos = tail & (r->size - 1);
+        size_t len = head - tail;
+        size_t first = r->size - pos < len ? r->size - pos : len;
+        iov[cnt].iov_base = r->data + pos;
+        iov[cnt].iov_len = first;
+        cnt++;
+        if (len > first) {
+            iov[cnt].iov_base = r->data;
+            iov[cnt].iov_len = len - first;
+            cnt++;
+        }
+        rings[nrings] = r;
+        heads[nrings] = head;
+        nrings++;
+
+        // full when the next ring could need 2 more iovecs, or there is no room to remember it
+        if (cnt > LOG_MAX_IOV - 2 || nrings == LOG_MAX_IOV / 2) {
+            write_all(fd, iov, cnt);
+            for (int i = 0; i < nrings; i++) atomic_store_explicit(&rings[i]->tail, heads[i], memory_order_release);
+            cnt = nrings = 0;
+        }
+    }
+    if (cnt > 0) {
+        write_all(fd, iov, cnt);
+        for (int i = 0; i < nrings; i++) atomic_store_explicit(&rings[i]->tail, heads[i], memory_order_release);
+    }
+    return dropped;
+}
+
+static void drain(void) {
+    pthread_mutex_lock(&g_flush_mutex);
+    if (g_fd < 0) {
+        pthread_mutex_unlock(&g_flush_mutex);
+        return;
+    }
+    unsigned long dropped = drain_rings(0, g_fd);
+    check_rotation();
+    unsigned long dropped_msgs = drain_rings(1, STDERR_FILENO);
+    pthread_mutex_unlock(&g_flush_mutex);
+
+    // these go out with the next drain
+    if (dropped > 0) LOG_WARN("[LOG] %lu access log lines dropped (buffer full)", dropped);
+    if (dropped_msgs > 0) LOG_WARN("[LOG] %lu messages dropped (buffer full)", dropped_msgs);
+}
+
+void logger_flush(void) {
+    drain();
+}
+
+static void* flusher(void* arg) {
+    (void)arg;
+    struct timespec period = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_MS * 1000000L };
+    // SIGINT/SIGTERM are blocked everywhere else, so they come here: write what is left and exit
+    // (the other threads just die with the process, like they did before)
+    while (1) {
+        int sig = sigtimedwait(&g_stop_signals, NULL, &period);
+        drain();
+        if (sig > 0) _exit(0);
+    }
+    return NULL;
+}
+
+int logger_init(const char* path, sem_t* rotate_sem) {
+    snprintf(g_path, sizeof(g_path), "%s", (path && path[0]) ? path : LOG_FILE);
+    g_rotate_sem = rotate_sem;
+    if (open_log() != 0) return -1;
+
+    sigemptyset(&g_stop_signals);
+    sigaddset(&g_stop_signals, SIGINT);
+    sigaddset(&g_stop_signals, SIGTERM);
+
+    // the flusher starts with every signal blocked, it only takes the stop signals with sigtimedwait
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, flusher, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        close(g_fd);
+        g_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    atomic_store_explicit(&g_started, 1, memory_order_release);
+    pthread_sigmask(SIG_BLOCK, &g_stop_signals, NULL);
+    atexit(logger_flush); // a worker that returns normally (master gone) keeps its last lines
+    return 0;
+}
@@ -5,7 +5,46 @@
 #include <stddef.h>
 #include <semaphore.h>
 
-void log_request(sem_t* log_sem, const char* client_ip, const char* method,
+#define LOG_FILE "access.log"               // when the config has no LOG_FILE
+#define LOG_MAX_SIZE (10 * 1024 * 1024)     // 10MB, then the file is renamed and a new one started
+#define LOG_RING_SIZE (256 * 1024)          // per thread buffer of lines the flusher didnt write yet
+#define LOG_FLUSH_MS 50                     // how often the flusher writes them out
+
+// Start the flusher thread of this process, lines go to path (appended, shared with the other
+// workers). rotate_sem makes sure only one worker renames the file when it gets too big.
+// Blocks SIGINT/SIGTERM in the calling thread so threads created after it leave them to the
+// flusher, which writes what is left before the process exits
+int logger_init(const char* path, sem_t* rotate_sem);
+
+// Never waits for the disk: the line goes to this thread's ring, if the ring is full it is dropped
+// (and counted on stderr)
+void log_request(const char* client_ip, const char* method,
                  const char* path, int status, size_t bytes);
 
-#endif
\ No newline at end of file
+// Write everything buffered so far (the flusher does it every LOG_FLUSH_MS anyway)
+void logger_flush(void);
+
+// Leveled messages for stderr (errors, startup info, per request debug). A call below LOG_LEVEL
+// is a constant false if and compiles to nothing, so the default build (INFO) has no debug output
+// on the request path; "make LOG_LEVEL=4" brings the debug lines back
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_MSG_RING_SIZE (16 * 1024)       // per thread buffer of messages, same flusher as the access log
+
+// Once the logger is started the message goes to this thread's ring (dropped if full, never
+// waits), before that (master, startup) it is written straight to stderr with one write()
+void log_message(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...) do { if ((level) <= LOG_LEVEL) log_message((level), __VA_ARGS__); } while (0)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
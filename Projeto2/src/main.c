@@ -12,8 +12,10 @@
 #include "logger.h"
 #include "stats.h"
 #include "cache.h"
+#include "preload.h"
 #include "http.h"
 #include "thread_pool.h"
+#include "dispatch.h"
 
 int main() {
     server_config_t config;
@@ -24,7 +26,7 @@ int main() {
     }
 
     // 1. Create shared memory
-    shared_data_t* shared = create_shared_memory();
+    shared_data_t* shared = create_shared_memory(config.num_workers);
     if (!shared) {
         perror("create_shared_memory");
         exit(1);
@@ -37,28 +39,108 @@ int main() {
         exit(1);
     }
 
-    // 3. Create listening socket
-    int listen_fd = create_server_socket(config.port);
-    if (listen_fd < 0) {
-        perror("create_server_socket");
+    // 3. Create listening socket(s): one shared by everyone, or with SO_REUSEPORT one per worker
+    // (or per event loop thread) so the kernel balances the connections instead of whoever wakes first.
+    // In dispatch mode only the master has one and each worker gets a channel to receive fds instead
+    int reuseport = (config.listen_mode == LISTEN_MODE_WORKER || config.listen_mode == LISTEN_MODE_THREAD);
+    int dispatch = (config.listen_mode == LISTEN_MODE_DISPATCH);
+    if (dispatch && config.num_workers > MAX_WORKERS) {
+        fprintf(stderr, "NUM_WORKERS limited to %d in dispatch mode\n", MAX_WORKERS);
+        config.num_workers = MAX_WORKERS;
+    }
+    int per_worker = 1;
+    if (config.listen_mode == LISTEN_MODE_THREAD && config.worker_mode == WORKER_MODE_EPOLL)
+        per_worker = (config.threads_per_worker > 0) ? config.threads_per_worker : 10;
+    int nlisten = reuseport ? config.num_workers * per_worker : 1;
+    int* listen_fds = malloc(sizeof(int) * (nlisten > 0 ? nlisten : 1));
+    if (!listen_fds) {
+        perror("malloc");
+        exit(1);
+    }
+    if (!reuseport) {
+        listen_fds[0] = create_server_socket(config.port);
+        if (listen_fds[0] < 0) {
+            perror("create_server_socket");
+            exit(1);
+        }
+    } else if (create_reuseport_sockets(config.port, nlisten, config.reuseport_cpu, listen_fds) != 0) {
+        perror("create_reuseport_sockets");
         exit(1);
     }
+    int* channels = NULL;
+    if (dispatch) {
+        channels = malloc(sizeof(int) * 2 * config.num_workers);
+        if (!channels || create_dispatch_channels(config.num_workers, channels) != 0) {
+            perror("create_dispatch_channels");
+            exit(1);
+        }
+    }
 
-    // 4. Fork workers
+    // 4. Create the file cache before fork: each worker gets its own copy, or in shared mode
+    // they all map the same segment (one budget and one hit set for every worker)
+    size_t cache_bytes = 10 * 1024 * 1024;//default the 10MB if cant read from config
+    if (config.cache_size_mb > 0) cache_bytes = (size_t)config.cache_size_mb * 1024 * 1024;
+    shm_cache_t* shm_cache = NULL;
+    file_cache_t* cache = NULL;
+    if (config.cache_shared) {
+        shm_cache = create_shared_cache(cache_bytes);
+        if (shm_cache) cache = cache_create_shared(shm_cache);
+    } else {
+        cache = cache_create(cache_bytes);
+    }
+    if (!cache) {
+        perror("Couldnt create cache");
+        exit(1);
+    }
+    // entries keep their 200 headers, a hit only adds the status line, Date and Connection
+    cache_set_render(cache, worker_render_headers);
+
+    // the hot files go in now, before anyone accepts: every worker starts with them
+    // (connections that arrive meanwhile wait in the listen backlog)
+    cache_preload(cache, &config, cache_bytes);
+
+    // 5. Fork workers
     for (int i = 0; i < config.num_workers; i++) {
         pid_t pid = fork();
         if (pid == 0) {
-            run_worker_process(listen_fd, shared, &sems, &config);
+            if (dispatch) {
+                // the worker only talks to the master: its own channel end, nothing else
+                close(listen_fds[0]);
+                for (int j = 0; j < config.num_workers; j++) {
+                    close(channels[j * 2]);
+                    if (j != i) close(channels[j * 2 + 1]);
+                }
+                run_worker_process(&channels[i * 2 + 1], 1, i, shared, &sems, &config, cache);
+            } else if (!reuseport) {
+                run_worker_process(listen_fds, 1, i, shared, &sems, &config, cache);
+            } else {
+                // keep only our own sockets, a socket nobody accepts on would still get its share
+                for (int j = 0; j < nlisten; j++)
+                    if (j / per_worker != i) close(listen_fds[j]);
+                run_worker_process(listen_fds + i * per_worker, per_worker, i, shared, &sems, &config, cache);
+            }
             exit(0);
         }
     }
 
-    // 5. Master loop
-    run_master(listen_fd, shared, &sems, &config);
+    // 6. Master loop (in reuseport mode the master must not hold the workers' sockets either)
+    int master_fd = listen_fds[0];
+    if (reuseport) {
+        for (int j = 0; j < nlisten; j++) close(listen_fds[j]);
+        master_fd = -1;
+    }
+    if (dispatch) {
+        for (int j = 0; j < config.num_workers; j++) close(channels[j * 2 + 1]);
+    }
+    run_master(master_fd, channels, shared, &config);
 
-    // 6. Cleanup (master only)
+    // 7. Cleanup (master only)
+    cache_destroy(cache);
+    if (shm_cache) destroy_shared_cache(shm_cache);
     destroy_semaphores(&sems);
     destroy_shared_memory(shared);
+    free(listen_fds);
+    free(channels);
 
     return 0;
 }
\ No newline at end of file
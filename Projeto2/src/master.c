@@ -4,12 +4,15 @@
 #include "semaphores.h"
 #include "stats.h"
 #include "config.h"
+#include "dispatch.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <signal.h>
 #include <errno.h>
 #include <string.h>
@@ -21,12 +24,20 @@ void signal_handler(int signum) {
     keep_running = 0;
 }
 
-int create_server_socket(int port) {
+static int open_listen_socket(int port, int reuseport) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) return -1;
 
     int opt = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // several sockets on the same port, the kernel spreads the new connections between them
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    // only wake accept() when the request bytes arrived, so the first read of a connection has data
+    int defer = 5;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
 
     struct sockaddr_in addr;
     addr.sin_family      = AF_INET;
@@ -46,7 +57,44 @@ int create_server_socket(int port) {
     return sockfd;
 }
 
-static void send_503(int client_fd) {
+int create_server_socket(int port) {
+    return open_listen_socket(port, 0);
+}
+
+int create_reuseport_sockets(int port, int count, int cpu_steering, int* fds) {
+    // all created here in order, so socket i is index i of the reuseport group (what the
+    // steering program returns) no matter in which order the workers start
+    for (int i = 0; i < count; i++) {
+        fds[i] = open_listen_socket(port, 1);
+        if (fds[i] < 0) {
+            while (--i >= 0) close(fds[i]);
+            return -1;
+        }
+    }
+    if (!cpu_steering) return 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > ncpus) {
+        // sockets past the last cpu would never be picked, keep the hash for everyone
+        fprintf(stderr, "[MASTER] %d listeners for %ld cpus, cpu steering disabled\n", count, ncpus);
+        return 0;
+    }
+
+    // classic BPF run for every new connection: A = cpu that got the SYN, return A % count.
+    // With socket i served on cpu i the whole connection stays on one cpu (cache and softirq)
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_W | BPF_ABS, 0, 0, (unsigned int)(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (unsigned int)count },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+    // one socket is enough, the program belongs to the whole group
+    if (setsockopt(fds[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF (using the default hash)");
+    }
+    return 0;
+}
+
+void send_503(int client_fd) {
     const char resp[] =
         "HTTP/1.1 503 Service Unavailable\r\n"
         "Content-Length: 19\r\n"
@@ -54,76 +102,132 @@ static void send_503(int client_fd) {
         "Connection: close\r\n"
         "\r\n"
         "Service Unavailable";
-    send(client_fd, resp, sizeof(resp) - 1, 0);
-    close(client_fd); // Only close here on error
+    // closing with the request still unread makes the kernel send a RST, and the client would
+    // lose the 503 with it. Best effort: never wait for a client we are trying to get rid of
+    char discard[4096];
+    while (recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {}
+    send(client_fd, resp, sizeof(resp) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
 }
 
-// Producer: push client_fd into shared queue
-static void enqueue_connection(shared_data_t* data,
-                               semaphores_t* sems,
-                               int client_fd) {
-    if (sem_trywait(sems->empty_slots) == -1) {
-        if (errno == EAGAIN) {
-            send_503(client_fd); // Queue full: close/503
-            return;
-        } else {
-            perror("sem_trywait(empty_slots)");
-            close(client_fd); // error: close
+// Producer: pass client_fd to the worker with the fewest connections in flight.
+// channels[i*2] is our end of worker i's socketpair (see create_dispatch_channels)
+static void dispatch_connection(shared_data_t* data, const int* channels, int nworkers, int client_fd) {
+    static int start = 0; // ties go round robin, otherwise an idle server would feed only worker 0
+    int tried[MAX_WORKERS] = {0};
+
+    for (int attempt = 0; attempt < nworkers; attempt++) {
+        int best = -1;
+        int best_load = 0;
+        for (int k = 0; k < nworkers; k++) {
+            int i = (start + k) % nworkers;
+            if (tried[i]) continue;
+            int load = atomic_load_explicit(&data->load[i].inflight, memory_order_relaxed);
+            if (best < 0 || load < best_load) {
+                best = i;
+                best_load = load;
+            }
+        }
+        start = (start + 1) % nworkers;
+
+        // counted before the send, the worker may close it before sendmsg even returns
+        atomic_fetch_add_explicit(&data->load[best].inflight, 1, memory_order_relaxed);
+        if (send_fd(channels[best * 2], client_fd) == 0) {
+            close(client_fd); // the worker has its own copy now
             return;
         }
+        atomic_fetch_sub_explicit(&data->load[best].inflight, 1, memory_order_relaxed);
+        tried[best] = 1; // channel full (worker not keeping up) or worker gone, try the next one
     }
-
-    sem_wait(sems->queue_mutex);
-    // Only the worker will close client_fd!
-    data->queue.sockets[data->queue.rear] = client_fd;
-    data->queue.rear  = (data->queue.rear + 1) % MAX_QUEUE_SIZE;
-    data->queue.count++;
-    sem_post(sems->queue_mutex);
-    sem_post(sems->filled_slots);
+    // nobody can take it: close/503
+    send_503(client_fd);
+    close(client_fd);
+    stats_record_shed(data);
 }
 
 //put only the error codes we found necessary for our project consult semrush blog to see more about them
-static void print_stats(const shared_data_t* shared, const semaphores_t* sems) {
-    sem_wait(sems->stats_mutex);
+// a percentile in ms, or "> last bound" when it landed past the histogram (see stats_percentile_us)
+static void format_ms(char* out, size_t size, uint64_t us) {
+    if (us == UINT64_MAX)
+        snprintf(out, size, ">%.3f", stats_hist_upper_us(STATS_HIST_BUCKETS - 1) / 1000.0);
+    else
+        snprintf(out, size, "%.3f", us / 1000.0);
+}
+
+static void print_stats(const shared_data_t* shared) {
+    server_stats_t stats;
+    stats_snapshot(shared, &stats); // adds up the per thread slots, nobody waits for us
     printf("\n------ Server Stats ------\n");
-    printf("Total requests:      %ld\n", shared->stats.total_requests);
-    printf("Bytes transferred:   %ld\n", shared->stats.bytes_transferred);
-    printf("HTTP 200 responses:  %ld\n", shared->stats.status_200);
-    printf("HTTP 403 responses:  %ld\n", shared->stats.status_403);
-    printf("HTTP 400 responses:  %ld\n", shared->stats.status_400);
-    printf("HTTP 405 responses:  %ld\n", shared->stats.status_405);
-    printf("HTTP 404 responses:  %ld\n", shared->stats.status_404);
-    printf("HTTP 500 responses:  %ld\n", shared->stats.status_500);
-    printf("Active connections:  %d\n",  shared->stats.active_connections);
+    printf("Total requests:      %ld\n", stats.total_requests);
+    printf("Bytes transferred:   %ld\n", stats.bytes_transferred);
+    printf("HTTP 200 responses:  %ld\n", stats.status_200);
+    printf("HTTP 206 responses:  %ld\n", stats.status_206);
+    printf("HTTP 304 responses:  %ld\n", stats.status_304);
+    printf("HTTP 403 responses:  %ld\n", stats.status_403);
+    printf("HTTP 400 responses:  %ld\n", stats.status_400);
+    printf("HTTP 405 responses:  %ld\n", stats.status_405);
+    printf("HTTP 414 responses:  %ld\n", stats.status_414);
+    printf("HTTP 416 responses:  %ld\n", stats.status_416);
+    printf("HTTP 404 responses:  %ld\n", stats.status_404);
+    printf("HTTP 500 responses:  %ld\n", stats.status_500);
+    printf("Active connections:  %d\n",  stats.active_connections);
+    printf("Shed (503):          %ld\n", stats.requests_shed);
+    static const char* classes[STATS_CLASSES] = { "2xx", "3xx", "4xx", "5xx" };
+    for (int c = 0; c < STATS_CLASSES; c++) {
+        uint64_t p50 = stats_percentile_us(&stats, c, 0.50);
+        if (p50 == 0) continue; // no requests in this class
+        char p[3][32];
+        format_ms(p[0], sizeof(p[0]), p50);
+        format_ms(p[1], sizeof(p[1]), stats_percentile_us(&stats, c, 0.99));
+        format_ms(p[2], sizeof(p[2]), stats_percentile_us(&stats, c, 0.999));
+        printf("Latency %s p50/p99/p99.9: %s / %s / %s ms\n", classes[c], p[0], p[1], p[2]);
+    }
     printf("--------------------------\n");
-    sem_post(sems->stats_mutex);
 }
 
-static void stats_loop(const shared_data_t* shared, const semaphores_t* sems) {
+static void stats_loop(const shared_data_t* shared) {
     while (keep_running) {
         sleep(10);
-        print_stats(shared, sems);
+        print_stats(shared);
     }
 }
 
 void run_master(int listen_fd,
+                const int* channels,
                 shared_data_t* shared,
-                semaphores_t* sems,
                 const server_config_t* config) {
    
 
+    // "pkill -USR1 myserver" is meant for the workers' request traces (TRACE_REQUESTS)
+    signal(SIGUSR1, SIG_IGN);
+
     // Start stats printer(smart)
     pid_t stats_pid = fork();
     if (stats_pid == 0) {
-        stats_loop(shared, sems);
+        if (channels) { // only the master may hold them, the workers see EOF when it goes away
+            for (int i = 0; i < config->num_workers; i++) close(channels[i * 2]);
+        }
+        stats_loop(shared);
         exit(0);
     }
 
-    // Master just waits until signaled to stop
-    while (keep_running) {
-        sleep(1);
+    if (channels) {
+        // dispatch mode: the master is the only one accepting
+        while (keep_running) {
+            int client_fd = accept(listen_fd, NULL, NULL);
+            if (client_fd < 0) {
+                if (errno == EINTR) continue;
+                perror("accept");
+                continue;
+            }
+            dispatch_connection(shared, channels, config->num_workers, client_fd);
+        }
+    } else {
+        // Master just waits until signaled to stop
+        while (keep_running) {
+            sleep(1);
+        }
     }
 
-    close(listen_fd);
+    if (listen_fd >= 0) close(listen_fd);
     kill(stats_pid, SIGTERM);
 }
\ No newline at end of file
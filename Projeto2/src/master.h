@@ -8,9 +8,18 @@
 // From master.c:
 int create_server_socket(int port);
 
+// Write a short "503 Service Unavailable" (Connection: close) without blocking, the caller closes
+void send_503(int client_fd);
+
+// LISTEN_MODE=worker|thread: count SO_REUSEPORT sockets on port, written to fds[0..count-1].
+// cpu_steering sends each connection to socket (cpu % count), see REUSEPORT_CPU_AFFINITY
+int create_reuseport_sockets(int port, int count, int cpu_steering, int* fds);
+
+// channels: our ends of the workers' socketpairs in LISTEN_MODE=dispatch (the master accepts and
+// hands out the connections), NULL otherwise
 void run_master(int listen_fd,
+                const int* channels,
                 shared_data_t* shared,
-                semaphores_t* sems,
                 const server_config_t* config);
 
 #endif
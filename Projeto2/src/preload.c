@@ -0,0 +1,290 @@
+// preload.c
+#define _GNU_SOURCE // d_type
+#include "preload.h"
+#include "worker.h"
+#include "http.h"
+#include "gzip.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define PRELOAD_MAX_THREADS 8
+#define PRELOAD_MAX_DEPTH 16
+#define PRELOAD_INDEX_SLOTS 32768 // power of 2, more than twice PRELOAD_MAX_FILES
+
+// A request path and how often the manifest asks for it
+typedef struct {
+    char* path;
+    long hits;
+    size_t order;   // first time it was seen, ties keep the manifest order
+} hot_path_t;
+
+typedef struct {
+    hot_path_t items[PRELOAD_MAX_FILES];
+    size_t count;
+    int slots[PRELOAD_INDEX_SLOTS]; // index + 1 into items, 0 = empty
+} path_list_t;
+
+typedef struct {
+    file_cache_t* cache;
+    char** files;           // cache keys (document root + path), hottest first
+    size_t nfiles;
+    size_t max_bytes;
+    size_t max_file;        // from SENDFILE_THRESHOLD_KB up the workers never cache a file either
+    atomic_size_t next;
+    atomic_size_t done;
+    atomic_size_t loaded;
+    atomic_size_t bytes;
+    atomic_size_t shard_bytes[CACHE_SHARDS];
+} preload_t;
+
+// Takes n bytes of the budget and of the shard's room (local cache only): past its max_size a shard
+// would evict the hotter files put there before to make room. 0 if they dont fit
+static int reserve(preload_t* pl, int shard, size_t n) {
+    if (atomic_fetch_add(&pl->bytes, n) + n > pl->max_bytes) {
+        atomic_fetch_sub(&pl->bytes, n);
+        return 0;
+    }
+    if (!pl->cache->shm && atomic_fetch_add(&pl->shard_bytes[shard], n) + n > pl->cache->shards[shard].max_size) {
+        atomic_fetch_sub(&pl->shard_bytes[shard], n);
+        atomic_fetch_sub(&pl->bytes, n);
+        return 0;
+    }
+    return 1;
+}
+
+static void unreserve(preload_t* pl, int shard, size_t n) {
+    atomic_fetch_sub(&pl->bytes, n);
+    if (!pl->cache->shm) atomic_fetch_sub(&pl->shard_bytes[shard], n);
+}
+
+// the same paths build_response would serve (no "..", it gets a 403)
+static void add_path(path_list_t* list, const char* path, size_t len) {
+    if (len == 0 || len >= 512 || path[0] != '/') return;
+    char p[512];
+    memcpy(p, path, len);
+    p[len] = '\0';
+    if (strstr(p, "..")) return;
+
+    size_t i = cache_hash(p) & (PRELOAD_INDEX_SLOTS - 1);
+    while (list->slots[i]) {
+        hot_path_t* item = &list->items[list->slots[i] - 1];
+        if (strcmp(item->path, p) == 0) {
+            item->hits++;
+            return;
+        }
+        i = (i + 1) & (PRELOAD_INDEX_SLOTS - 1);
+    }
+    if (list->count == PRELOAD_MAX_FILES) return;
+    hot_path_t* item = &list->items[list->count];
+    item->path = strdup(p);
+    if (!item->path) return;
+    item->hits = 1;
+    item->order = list->count;
+    list->slots[i] = (int)++list->count;
+}
+
+// "/index.html", or an access log line:
+// 127.0.0.1 - - [01/Jan/2025:12:00:00 +0000] "GET /index.html HTTP/1.1" 200 166
+static void parse_line(path_list_t* list, const char* line) {
+    const char* q = strchr(line, '"');
+    if (!q) {
+        while (*line == ' ' || *line == '\t') line++;
+        size_t len = strcspn(line, " \t\r\n");
+        add_path(list, line, len);
+        return;
+    }
+    const char* method = q + 1;
+    if (strncmp(method, "GET ", 4) != 0 && strncmp(method, "HEAD ", 5) != 0) return;
+    const char* path = strchr(method, ' ') + 1;
+    size_t len = strcspn(path, " \"");
+    const char* end = strchr(path + len, '"');
+    int status = end ? atoi(end + 1) : 0;
+    if (status == 200 || status == 206 || status == 304) add_path(list, path, len); // errors are not hot
+}
+
+static int read_manifest(path_list_t* list, const char* filename) {
+    FILE* f = fopen(filename, "r");
+    if (!f) return -1;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        parse_line(list, line);
+    }
+    fclose(f);
+    return 0;
+}
+
+// every regular file under dir, hidden ones (.git, editor temp files) left out
+static void walk(path_list_t* list, const char* root, const char* rel, int depth) {
+    if (depth > PRELOAD_MAX_DEPTH || list->count == PRELOAD_MAX_FILES) return;
+    char dir_path[1024];
+    snprintf(dir_path, sizeof(dir_path), "%s%s", root, rel);
+    DIR* dir = opendir(dir_path);
+    if (!dir) return;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL && list->count < PRELOAD_MAX_FILES) {
+        if (de->d_name[0] == '.') continue;
+        char sub[512];
+        int n = snprintf(sub, sizeof(sub), "%s/%s", rel, de->d_name);
+        if (n < 0 || (size_t)n >= sizeof(sub)) continue;
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            char full[1536];
+            struct stat st;
+            snprintf(full, sizeof(full), "%s%s", root, sub);
+            if (lstat(full, &st) != 0) continue;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR) walk(list, root, sub, depth + 1);
+        else if (type == DT_REG) add_path(list, sub, (size_t)n);
+    }
+    closedir(dir);
+}
+
+static int hottest_first(const void* a, const void* b) {
+    const hot_path_t* x = a;
+    const hot_path_t* y = b;
+    if (x->hits != y->hits) return x->hits > y->hits ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void load_file(preload_t* pl, const char* path) {
+    unsigned long generation = cache_generation(pl->cache, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (size_t)st.st_size >= pl->max_file) {
+        close(fd);
+        return;
+    }
+    size_t sz = (size_t)st.st_size;
+    // what does not fit is skipped, a smaller file further down the list may still fit. The entry
+    // also keeps its rendered headers, counted at their most until it is in
+    int shard = cache_shard_index(cache_hash(path));
+    size_t reserved = sz + CACHE_HEADERS_MAX;
+    if (!reserve(pl, shard, reserved)) {
+        close(fd);
+        return;
+    }
+    char* contents = malloc(sz);
+    size_t got = 0;
+    while (contents && got < sz) {
+        ssize_t n = read(fd, contents + got, sz - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(fd);
+
+    // the gzip variant is made here too, so a preloaded file is served the same as one a worker
+    // cached. It needs room of its own, without it the file still goes in plain
+    cache_entry_t* entry = NULL;
+    unsigned char* gz = NULL;
+    size_t gz_size = 0;
+    if (contents && got == sz) {
+        file_validators_t validators;
+        http_file_validators(&st, &validators);
+        gz = gzip_variant(get_mime_type(path), (unsigned char*)contents, sz, &gz_size);
+        if (gz && reserve(pl, shard, gz_size)) {
+            reserved += gz_size;
+        } else {
+            free(gz);
+            gz = NULL;
+        }
+        entry = cache_put(pl->cache, path, (unsigned char*)contents, sz, &validators, gz, gz_size, generation);
+    }
+    if (entry) {
+        unreserve(pl, shard, reserved - (entry->size + entry->gzip_size + entry->headers_len));
+        cache_release(entry);
+        atomic_fetch_add(&pl->loaded, 1);
+    } else {
+        free(contents);
+        free(gz);
+        unreserve(pl, shard, reserved);
+    }
+}
+
+static void* preload_thread(void* arg) {
+    preload_t* pl = (preload_t*)arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&pl->next, 1)) < pl->nfiles) {
+        load_file(pl, pl->files[i]);
+        atomic_fetch_add(&pl->done, 1);
+    }
+    return NULL;
+}
+
+static long elapsed_ms(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+void cache_preload(file_cache_t* cache, const server_config_t* config, size_t max_bytes) {
+    const char* source = config->cache_preload;
+    if (source[0] == '\0' || strcmp(source, "off") == 0) return;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    path_list_t* list = calloc(1, sizeof(path_list_t));
+    if (!list) return;
+    if (strcmp(source, "docroot") == 0) {
+        walk(list, config->document_root, "", 0);
+    } else if (read_manifest(list, source) != 0) {
+        LOG_WARN("Preload: cant read %s: %s", source, strerror(errno));
+        free(list);
+        return;
+    }
+    qsort(list->items, list->count, sizeof(hot_path_t), hottest_first);
+
+    preload_t pl = { .cache = cache, .max_bytes = max_bytes };
+    pl.max_file = (size_t)(config->sendfile_threshold_kb > 0 ? config->sendfile_threshold_kb
+                                                             : DEFAULT_SENDFILE_THRESHOLD_KB) * 1024;
+    pl.files = calloc(list->count ? list->count : 1, sizeof(char*));
+    for (size_t i = 0; pl.files && i < list->count; i++) {
+        char key[1024];
+        worker_file_path(config->document_root, list->items[i].path, key, sizeof(key));
+        pl.files[pl.nfiles] = strdup(key);
+        if (pl.files[pl.nfiles]) pl.nfiles++;
+    }
+    for (size_t i = 0; i < list->count; i++) free(list->items[i].path);
+    free(list);
+    LOG_INFO("Preload: %zu paths from %s, up to %zu MB", pl.nfiles, source, max_bytes / (1024 * 1024));
+
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = ncpus < 1 ? 1 : ncpus > PRELOAD_MAX_THREADS ? PRELOAD_MAX_THREADS : (int)ncpus;
+    pthread_t tids[PRELOAD_MAX_THREADS];
+    int started = 0;
+    while (started < nthreads && pthread_create(&tids[started], NULL, preload_thread, &pl) == 0) started++;
+    if (started == 0) preload_thread(&pl); // no threads: this one reads them all
+
+    // progress twice a second until the readers are done
+    size_t reported = 0;
+    for (int ticks = 1; started > 0 && atomic_load(&pl.done) < pl.nfiles; ticks++) {
+        struct timespec tick = { 0, 50 * 1000000L };
+        nanosleep(&tick, NULL);
+        size_t done = atomic_load(&pl.done);
+        if (ticks % 10 == 0 && done != reported && done < pl.nfiles) {
+            LOG_INFO("Preload: %zu/%zu files, %zu cached (%zu KB)", done, pl.nfiles,
+                     atomic_load(&pl.loaded), atomic_load(&pl.bytes) / 1024);
+            reported = done;
+        }
+    }
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+
+    LOG_INFO("Preload done: %zu of %zu files cached (%zu KB) in %ld ms", atomic_load(&pl.loaded), pl.nfiles,
+             atomic_load(&pl.bytes) / 1024, elapsed_ms(&start));
+    for (size_t i = 0; i < pl.nfiles; i++) free(pl.files[i]);
+    free(pl.files);
+}
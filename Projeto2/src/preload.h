@@ -0,0 +1,22 @@
+// preload.h
+#ifndef PRELOAD_H
+#define PRELOAD_H
+
+#include <stddef.h>
+#include "cache.h"
+#include "config.h"
+
+// most files one preload looks at (manifest lines or files found walking the document root)
+#define PRELOAD_MAX_FILES 10000
+
+// Fill the cache before the workers are forked, so they all start with it (a copy each, or the
+// shared segment). CACHE_PRELOAD picks what goes in:
+//   "docroot"  every file under DOCUMENT_ROOT (up to PRELOAD_MAX_FILES)
+//   a file     one request path per line ("/index.html"), or an access log: the most requested
+//              paths go first
+// Stops adding once max_bytes (CACHE_SIZE_MB) are in, and skips a file whose shard is full (it
+// would evict the hotter files put there first). A few threads read the files, the
+// progress goes to the log
+void cache_preload(file_cache_t* cache, const server_config_t* config, size_t max_bytes);
+
+#endif
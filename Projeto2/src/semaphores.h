@@ -8,8 +8,7 @@ typedef struct {
     sem_t* empty_slots; //empty for master to produce
     sem_t* filled_slots; //filled for workers to consume
     sem_t* queue_mutex; //mutual exclusion
-    sem_t* stats_mutex; //stats protection
-    sem_t* log_mutex;
+    sem_t* log_mutex; //access log rotation
 } semaphores_t;
 
 
@@ -6,27 +6,99 @@
 #include <string.h>
 
 #define SHM_NAME "/webserver_shm"
+#define SHM_CACHE_NAME "/webserver_cache"
+
+shared_data_t* create_shared_memory(int nworkers) {
+    if (nworkers < 1) nworkers = 1;
+    if (nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+    size_t size = offsetof(shared_data_t, stats) + (size_t)(nworkers + 1) * sizeof(((shared_data_t*)0)->stats[0]);
 
-shared_data_t* create_shared_memory() {
     int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666);
     if (shm_fd == -1) return NULL;
 
-    if (ftruncate(shm_fd, sizeof(shared_data_t)) == -1) {
+    if (ftruncate(shm_fd, size) == -1) {
         close(shm_fd);
         return NULL;
     }
 
-    shared_data_t* data = mmap(NULL, sizeof(shared_data_t),
+    shared_data_t* data = mmap(NULL, size,
                                PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     close(shm_fd);
 
     if (data == MAP_FAILED) return NULL;
 
-    memset(data, 0, sizeof(shared_data_t));
+    memset(data, 0, size);
+    data->map_size = size;
+    data->stats_rows = nworkers + 1;
     return data;
 }
 
 void destroy_shared_memory(shared_data_t* data) {
-    munmap(data, sizeof(shared_data_t));
+    munmap(data, data->map_size);
     shm_unlink(SHM_NAME);
-}
\ No newline at end of file
+}
+
+shm_cache_t* create_shared_cache(size_t data_bytes) {
+    size_t nslabs = data_bytes / SHM_CACHE_SLAB_SIZE;
+    if (nslabs == 0) nslabs = 1;
+    size_t nslots = nslabs * (SHM_CACHE_SLAB_SIZE / SHM_CACHE_AVG_FILE);
+    size_t nbuckets = 1;
+    while (nbuckets < nslots) nbuckets <<= 1;
+
+    // 64 byte aligned sections
+    size_t buckets_off = (sizeof(shm_cache_t) + 63) & ~(size_t)63;
+    size_t slots_off = (buckets_off + nbuckets * sizeof(uint32_t) + 63) & ~(size_t)63;
+    size_t data_off = (slots_off + nslots * sizeof(shm_cache_slot_t) + 4095) & ~(size_t)4095;
+    size_t map_size = data_off + nslabs * SHM_CACHE_SLAB_SIZE;
+
+    // start from a fresh segment so the kernel hands us zeroed pages and we dont touch the data area
+    shm_unlink(SHM_CACHE_NAME);
+    int shm_fd = shm_open(SHM_CACHE_NAME, O_CREAT | O_RDWR, 0666);
+    if (shm_fd == -1) return NULL;
+
+    if (ftruncate(shm_fd, map_size) == -1) {
+        close(shm_fd);
+        shm_unlink(SHM_CACHE_NAME);
+        return NULL;
+    }
+
+    shm_cache_t* shm = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (shm == MAP_FAILED) {
+        shm_unlink(SHM_CACHE_NAME);
+        return NULL;
+    }
+
+    shm->map_size = map_size;
+    shm->nslots = nslots;
+    shm->nbuckets = nbuckets;
+    shm->buckets_off = buckets_off;
+    shm->slots_off = slots_off;
+    shm->data_off = data_off;
+    shm->nslabs = nslabs;
+    shm->hand = SHM_NIL;
+
+    uint32_t* buckets = (uint32_t*)((char*)shm + buckets_off);
+    memset(buckets, 0xff, nbuckets * sizeof(uint32_t)); // all SHM_NIL
+
+    shm_cache_slot_t* slots = (shm_cache_slot_t*)((char*)shm + slots_off);
+    for (size_t i = 0; i < nslots; i++) {
+        slots[i].hnext = (i + 1 < nslots) ? (uint32_t)(i + 1) : SHM_NIL;
+    }
+    shm->free_slots = 0;
+
+    // the lock is used by every worker process
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&shm->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    return shm;
+}
+
+void destroy_shared_cache(shm_cache_t* shm) {
+    pthread_rwlock_destroy(&shm->rwlock);
+    munmap(shm, shm->map_size);
+    shm_unlink(SHM_CACHE_NAME);
+}
@@ -3,36 +3,133 @@
 #define SHARED_MEM_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "cache.h"
 #define MAX_QUEUE_SIZE 100
 #define STATUS_CODES_RANGE 600
 
 
-//strcture defined to hold the server stats
+// Latency histograms, one per status class (2xx 3xx 4xx 5xx), log-linear like HdrHistogram:
+// values in microseconds, each power of two split in 8 linear sub-buckets (at most 12.5% error)
+// from 1us to ~134s (2^27us), anything slower is only counted in latency_overflow. See stats_hist_bucket
+#define STATS_CLASSES 4
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_BUCKETS 200
+
+//strcture defined to hold the server stats (the sum of all the slots below, see stats_snapshot)
 typedef struct {
     long total_requests;
     long bytes_transferred;
     long status_200;
+    long status_206;
+    long status_304;
     long status_404;
     long status_500;
     long status_403;
     long status_400;
     long status_405;
+    long status_414;
+    long status_416;
     int active_connections;
+    long requests_shed;         // got a 503 because the worker queue was full or too slow (or no worker took it)
+    long latency_sum_us[STATS_CLASSES];
+    long latency[STATS_CLASSES][STATS_HIST_BUCKETS];
+    long latency_overflow[STATS_CLASSES];   // slower than the last bucket, only in the +Inf bucket
 } server_stats_t;
 
+// most workers the dispatcher can balance (LISTEN_MODE=dispatch), also the most rows of stats slots
+#define MAX_WORKERS 64
+
+// Stats are counted per thread so a request never waits on a lock for them: each worker has a row
+// of slots, each thread writes its own slot (relaxed atomics, one thread per slot in the normal case)
+// and the reader adds them all up. More threads than slots, or more workers than rows, just share one.
+// There is a row per configured worker (up to MAX_WORKERS) plus the master's, so a scrape only adds
+// up the rows that can be written
+#define STATS_THREAD_SLOTS 16
+
+// same fields as server_stats_t, on its own cache lines so two threads never write the same line
+typedef struct {
+    _Alignas(64) atomic_long total_requests;
+    atomic_long bytes_transferred;
+    atomic_long status_200;
+    atomic_long status_206;
+    atomic_long status_304;
+    atomic_long status_404;
+    atomic_long status_500;
+    atomic_long status_403;
+    atomic_long status_400;
+    atomic_long status_405;
+    atomic_long status_414;
+    atomic_long status_416;
+    atomic_int active_connections;   // +1 and -1 can land in different slots, only the sum means something
+    atomic_long requests_shed;
+    atomic_long latency_sum_us[STATS_CLASSES];
+    atomic_long latency[STATS_CLASSES][STATS_HIST_BUCKETS];
+    atomic_long latency_overflow[STATS_CLASSES];
+} stats_slot_t;
+
+// connections the master passed to a worker and the worker didnt close yet (queued, being
+// served or idle keep-alive). The master bumps it when it sends the fd, the worker drops it when
+// it closes the connection. One cache line each, the worker and the master write them all the time
 typedef struct {
-    int sockets[MAX_QUEUE_SIZE]; //holds the fd's
-    int front; //worker reads here
-    int rear; //master writes here
-    int count; //number of fd's in queue
-} connection_queue_t;
+    _Alignas(64) atomic_int inflight;
+} worker_load_t;
 
 typedef struct {
-    connection_queue_t queue;
-    server_stats_t stats; //server stats
+    worker_load_t load[MAX_WORKERS];
+    size_t map_size;
+    int stats_rows;             // workers' rows + 1, the last row is the master's (dispatcher 503s)
+    stats_slot_t stats[][STATS_THREAD_SLOTS]; //server stats
 } shared_data_t;
 
-shared_data_t* create_shared_memory();
+// segment with stats rows for nworkers workers (at most MAX_WORKERS) and the master
+shared_data_t* create_shared_memory(int nworkers);
 void destroy_shared_memory(shared_data_t* data);
 
+// Cross-process file cache (CACHE_MODE=shared), one segment for all the workers.
+// Layout: [shm_cache_t header][bucket array][slot table][data area in slabs]
+// Everything inside points to everything else by offset/slot index, the only pointers are the
+// entry.path/entry.data handed to readers, which are valid because the master maps the segment
+// before fork so it is at the same address in every worker.
+#define SHM_CACHE_SLAB_SIZE (1024*1024)  // data area is carved in 1MB slabs, also the biggest cacheable file
+#define SHM_CACHE_MIN_CHUNK 256          // smallest size class, each class doubles up to a full slab
+#define SHM_CACHE_CLASSES 13             // 256B, 512B ... 1MB
+#define SHM_CACHE_KEY_MAX 256            // longer paths are just not cached
+#define SHM_CACHE_AVG_FILE 4096          // used to size the slot table (one slot per 4KB of data)
+#define SHM_NIL UINT32_MAX               // "no slot"
+
+typedef struct {
+    cache_entry_t entry;        // what cache_get returns to the workers (must be first)
+    uint32_t hnext;             // next slot in the same hash bucket
+    uint32_t prev;              // CLOCK ring
+    uint32_t next;
+    uint32_t size_class;        // which free list the chunk goes back to
+    uint64_t chunk_off;         // offset of the data chunk from the start of the segment
+    int dead;                   // replaced while a sender still had it, waiting for the hand
+    char key[SHM_CACHE_KEY_MAX];
+} shm_cache_slot_t;
+
+struct shm_cache { // typedef shm_cache_t is in cache.h
+    pthread_rwlock_t rwlock;    // process shared, hits only take it for reading
+    size_t map_size;            // whole segment
+    uint32_t nslots;
+    uint32_t nbuckets;          // power of 2
+    uint64_t buckets_off;       // uint32_t[nbuckets] of slot indexes
+    uint64_t slots_off;         // shm_cache_slot_t[nslots]
+    uint64_t data_off;          // first slab
+    uint32_t nslabs;
+    uint32_t next_slab;         // slabs are handed to a size class once and stay there
+    uint32_t hand;              // CLOCK hand
+    uint32_t free_slots;        // free slot list (linked through hnext)
+    uint64_t free_chunks[SHM_CACHE_CLASSES]; // per class free lists (chunk offsets, 0 = empty)
+    size_t count;               // slots in the ring
+    size_t total_size;          // bytes of chunks in use
+    atomic_ulong generation;    // one for the whole segment, same as cache_shard_t.generation
+};
+
+shm_cache_t* create_shared_cache(size_t data_bytes);
+void destroy_shared_cache(shm_cache_t* shm);
+
 #endif
\ No newline at end of file
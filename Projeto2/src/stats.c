@@ -1,39 +1,210 @@
 #include "stats.h"
-#include "semaphores.h"
 #include "shared_mem.h"
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
 
+static int g_worker = -1; // the master, until stats_set_worker
+static atomic_int g_next_slot;
+static _Thread_local stats_slot_t* t_slot;
+
+void stats_set_worker(int worker_id) {
+    g_worker = worker_id;
+}
+
+// this thread's slot, picked once (threads of the process take them in order)
+static stats_slot_t* my_slot(shared_data_t* shared) {
+    if (!t_slot) {
+        int i = atomic_fetch_add_explicit(&g_next_slot, 1, memory_order_relaxed) % STATS_THREAD_SLOTS;
+        int row = g_worker < 0 ? shared->stats_rows - 1 : g_worker % (shared->stats_rows - 1);
+        t_slot = &shared->stats[row][i];
+    }
+    return t_slot;
+}
+
+
+void stats_increment_active(shared_data_t* shared) {
+    atomic_fetch_add_explicit(&my_slot(shared)->active_connections, 1, memory_order_relaxed);
+}
 
 
-void stats_increment_active(shared_data_t* shared, semaphores_t* sems) {
-    sem_wait(sems->stats_mutex);
-    shared->stats.active_connections++;
-    sem_post(sems->stats_mutex);
+void stats_decrement_active(shared_data_t* shared) {
+    atomic_fetch_sub_explicit(&my_slot(shared)->active_connections, 1, memory_order_relaxed);
 }
 
 
-void stats_decrement_active(shared_data_t* shared, semaphores_t* sems) {
-    sem_wait(sems->stats_mutex);
-    shared->stats.active_connections--;
-    sem_post(sems->stats_mutex);
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
 }
 
+// 0..7 exact, then 8 sub-buckets per power of two: [2^k, 2^(k+1)) split by the 3 bits after the top one
+int stats_hist_bucket(uint64_t us) {
+    const uint64_t sub = 1 << STATS_HIST_SUB_BITS;
+    if (us < sub) return (int)us;
+    int k = 63 - __builtin_clzll(us);
+    int shift = k - STATS_HIST_SUB_BITS;
+    int b = (int)sub + shift * (int)sub + (int)((us >> shift) & (sub - 1));
+    return b < STATS_HIST_BUCKETS ? b : STATS_HIST_BUCKETS;
+}
+
+uint64_t stats_hist_upper_us(int bucket) {
+    const int sub = 1 << STATS_HIST_SUB_BITS;
+    if (bucket < sub) return (uint64_t)bucket + 1;
+    int shift = (bucket - sub) / sub;
+    int low = (bucket - sub) % sub;
+    return (uint64_t)(sub + low + 1) << shift;
+}
 
-void stats_record_response(shared_data_t* shared, semaphores_t* sems, int status, long bytes) {
-    sem_wait(sems->stats_mutex);
-    shared->stats.total_requests++;
-    shared->stats.bytes_transferred += bytes;
+static int status_class(int status) {
+    int cls = status / 100 - 2; // 2xx -> 0 ... 5xx -> 3
+    if (cls < 0) cls = 0;
+    if (cls >= STATS_CLASSES) cls = STATS_CLASSES - 1;
+    return cls;
+}
+
+void stats_record_response(shared_data_t* shared, int status, long bytes, uint64_t latency_us) {
+    stats_slot_t* s = my_slot(shared);
+    int cls = status_class(status);
+    int b = stats_hist_bucket(latency_us);
+    atomic_fetch_add_explicit(b < STATS_HIST_BUCKETS ? &s->latency[cls][b] : &s->latency_overflow[cls], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->latency_sum_us[cls], (long)latency_us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->total_requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->bytes_transferred, bytes, memory_order_relaxed);
+    atomic_long* counter = NULL;
     if (status == 200)
-        shared->stats.status_200++;
+        counter = &s->status_200;
+    else if (status == 206)
+        counter = &s->status_206;
+    else if (status == 304)
+        counter = &s->status_304;
     else if (status == 404)
-        shared->stats.status_404++;
+        counter = &s->status_404;
     else if (status == 403)
-        shared->stats.status_403++;
+        counter = &s->status_403;
     else if (status == 400)
-        shared->stats.status_400++;
+        counter = &s->status_400;
     else if (status == 405)
-        shared->stats.status_405++;
+        counter = &s->status_405;
+    else if (status == 414)
+        counter = &s->status_414;
+    else if (status == 416)
+        counter = &s->status_416;
     else if (status == 500)
-        shared->stats.status_500++;
+        counter = &s->status_500;
     //if needed to add in the future other codes just add here(ask teacher about this) consult semrush blog to see more about them
-    sem_post(sems->stats_mutex);
-}
\ No newline at end of file
+    if (counter) atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
+}
+
+
+void stats_record_shed(shared_data_t* shared) {
+    atomic_fetch_add_explicit(&my_slot(shared)->requests_shed, 1, memory_order_relaxed);
+}
+
+
+void stats_snapshot(const shared_data_t* shared, server_stats_t* out) {
+    memset(out, 0, sizeof(*out));
+    for (int r = 0; r < shared->stats_rows; r++) {
+        for (int i = 0; i < STATS_THREAD_SLOTS; i++) {
+            const stats_slot_t* s = &shared->stats[r][i];
+            out->total_requests += atomic_load_explicit(&s->total_requests, memory_order_relaxed);
+            out->bytes_transferred += atomic_load_explicit(&s->bytes_transferred, memory_order_relaxed);
+            out->status_200 += atomic_load_explicit(&s->status_200, memory_order_relaxed);
+            out->status_206 += atomic_load_explicit(&s->status_206, memory_order_relaxed);
+            out->status_304 += atomic_load_explicit(&s->status_304, memory_order_relaxed);
+            out->status_404 += atomic_load_explicit(&s->status_404, memory_order_relaxed);
+            out->status_500 += atomic_load_explicit(&s->status_500, memory_order_relaxed);
+            out->status_403 += atomic_load_explicit(&s->status_403, memory_order_relaxed);
+            out->status_400 += atomic_load_explicit(&s->status_400, memory_order_relaxed);
+            out->status_405 += atomic_load_explicit(&s->status_405, memory_order_relaxed);
+            out->status_414 += atomic_load_explicit(&s->status_414, memory_order_relaxed);
+            out->status_416 += atomic_load_explicit(&s->status_416, memory_order_relaxed);
+            out->active_connections += atomic_load_explicit(&s->active_connections, memory_order_relaxed);
+            out->requests_shed += atomic_load_explicit(&s->requests_shed, memory_order_relaxed);
+            for (int c = 0; c < STATS_CLASSES; c++) {
+                out->latency_sum_us[c] += atomic_load_explicit(&s->latency_sum_us[c], memory_order_relaxed);
+                out->latency_overflow[c] += atomic_load_explicit(&s->latency_overflow[c], memory_order_relaxed);
+                for (int b = 0; b < STATS_HIST_BUCKETS; b++)
+                    out->latency[c][b] += atomic_load_explicit(&s->latency[c][b], memory_order_relaxed);
+            }
+        }
+    }
+}
+
+
+uint64_t stats_percentile_us(const server_stats_t* stats, int cls, double q) {
+    long total = stats->latency_overflow[cls];
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) total += stats->latency[cls][b];
+    if (total == 0) return 0;
+    long rank = (long)(q * (double)total + 0.5);
+    if (rank < 1) rank = 1;
+    long seen = 0;
+    for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += stats->latency[cls][b];
+        if (seen >= rank) return stats_hist_upper_us(b);
+    }
+    return UINT64_MAX;
+}
+
+// snprintf that keeps going at the end of buf and stops quietly once it is full
+static void append(char* buf, size_t size, size_t* len, const char* fmt, ...) {
+    if (*len >= size) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    *len = (size_t)n < size - *len ? *len + (size_t)n : size;
+}
+
+size_t stats_render_prometheus(const server_stats_t* stats, char* buf, size_t size) {
+    static const char* classes[STATS_CLASSES] = { "2xx", "3xx", "4xx", "5xx" };
+    static const struct { int code; size_t offset; } codes[] = {
+        { 200, offsetof(server_stats_t, status_200) },
+        { 206, offsetof(server_stats_t, status_206) },
+        { 304, offsetof(server_stats_t, status_304) },
+        { 400, offsetof(server_stats_t, status_400) },
+        { 403, offsetof(server_stats_t, status_403) },
+        { 404, offsetof(server_stats_t, status_404) },
+        { 405, offsetof(server_stats_t, status_405) },
+        { 414, offsetof(server_stats_t, status_414) },
+        { 416, offsetof(server_stats_t, status_416) },
+        { 500, offsetof(server_stats_t, status_500) },
+    };
+    size_t len = 0;
+    if (size == 0) return 0;
+    buf[0] = '\0';
+
+    append(buf, size, &len, "# HELP http_requests_total Requests answered.\n# TYPE http_requests_total counter\n");
+    append(buf, size, &len, "http_requests_total %ld\n", stats->total_requests);
+    append(buf, size, &len, "# HELP http_responses_total Responses by status code.\n# TYPE http_responses_total counter\n");
+    for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++)
+        append(buf, size, &len, "http_responses_total{code=\"%d\"} %ld\n",
+               codes[i].code, *(const long*)((const char*)stats + codes[i].offset));
+    append(buf, size, &len, "# HELP http_response_bytes_total Body bytes sent.\n# TYPE http_response_bytes_total counter\n");
+    append(buf, size, &len, "http_response_bytes_total %ld\n", stats->bytes_transferred);
+    append(buf, size, &len, "# HELP http_active_connections Requests being answered right now.\n# TYPE http_active_connections gauge\n");
+    append(buf, size, &len, "http_active_connections %d\n", stats->active_connections);
+    append(buf, size, &len, "# HELP http_requests_shed_total Connections answered 503 without being read (overload).\n# TYPE http_requests_shed_total counter\n");
+    append(buf, size, &len, "http_requests_shed_total %ld\n", stats->requests_shed);
+
+    append(buf, size, &len, "# HELP http_request_duration_seconds From a complete request to its last byte sent.\n"
+                            "# TYPE http_request_duration_seconds histogram\n");
+    for (int c = 0; c < STATS_CLASSES; c++) {
+        long cumulative = 0;
+        for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+            cumulative += stats->latency[c][b];
+            append(buf, size, &len, "http_request_duration_seconds_bucket{class=\"%s\",le=\"%.6f\"} %ld\n",
+                   classes[c], (double)stats_hist_upper_us(b) / 1e6, cumulative);
+        }
+        cumulative += stats->latency_overflow[c];
+        append(buf, size, &len, "http_request_duration_seconds_bucket{class=\"%s\",le=\"+Inf\"} %ld\n", classes[c], cumulative);
+        append(buf, size, &len, "http_request_duration_seconds_sum{class=\"%s\"} %.6f\n",
+               classes[c], (double)stats->latency_sum_us[c] / 1e6);
+        append(buf, size, &len, "http_request_duration_seconds_count{class=\"%s\"} %ld\n", classes[c], cumulative);
+    }
+    return len;
+}
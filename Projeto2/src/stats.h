@@ -2,16 +2,48 @@
 #define STATS_H
 
 #include "shared_mem.h"
-#include "semaphores.h"
 #include <stddef.h> // for size_t
+#include <stdint.h>
 
+// reserved path answered with the counters and histograms in Prometheus text format
+#define STATS_URL "/server-stats"
+// Bound for the text: STATS_CLASSES x (STATS_HIST_BUCKETS + 1) bucket lines of at most 88 bytes each
+// (a 19 digit count) plus ~3KB of counters, about 75KB at worst (~55KB while the counts are small)
+#define STATS_RENDER_MAX (128 * 1024)
 
-void stats_increment_active(shared_data_t* shared, semaphores_t* sems);
+// Row of stats slots this process writes to (called by each worker after fork, the master keeps
+// its own row). Threads take a slot of the row the first time they count something
+void stats_set_worker(int worker_id);
 
 
-void stats_decrement_active(shared_data_t* shared, semaphores_t* sems);
+void stats_increment_active(shared_data_t* shared);
 
 
-void stats_record_response(shared_data_t* shared, semaphores_t* sems, int status, long bytes);
+void stats_decrement_active(shared_data_t* shared);
 
-#endif
\ No newline at end of file
+// latency_us goes to the histogram of the status class
+void stats_record_response(shared_data_t* shared, int status, long bytes, uint64_t latency_us);
+
+// a connection answered with 503 before its request was read (load shedding)
+void stats_record_shed(shared_data_t* shared);
+
+// Sum of every slot. Not a consistent cut (requests keep being counted while we add), fine for printing
+void stats_snapshot(const shared_data_t* shared, server_stats_t* out);
+
+// monotonic clock in ns, what latencies are measured with
+uint64_t stats_now_ns(void);
+
+// Histogram bucket of a latency and the (exclusive) upper bound of a bucket, in microseconds.
+// A latency past the last bucket (le ~134s) gets STATS_HIST_BUCKETS, it is counted apart so every
+// le stays a real upper bound and only +Inf includes it
+int stats_hist_bucket(uint64_t us);
+uint64_t stats_hist_upper_us(int bucket);
+
+// Latency under which a fraction q (0..1) of the class's requests finished, 0 if it has none.
+// UINT64_MAX if it lands in the overflow (slower than the histogram goes)
+uint64_t stats_percentile_us(const server_stats_t* stats, int cls, double q);
+
+// Prometheus text exposition of a snapshot, returns the bytes written (cut at size)
+size_t stats_render_prometheus(const server_stats_t* stats, char* buf, size_t size);
+
+#endif
@@ -1,94 +1,170 @@
 #include "thread_pool.h"
 #include "worker.h"
+#include "conn.h"
+#include "master.h"
+#include "stats.h"
+#include "trace.h"
+#include "logger.h"
 #include <stdlib.h>
-#include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
 
-// Usa o mutex global do worker.c
-extern pthread_mutex_t print_mutex;
+extern shared_data_t* g_shared;
 
-void* worker_thread(void* arg) {
-    thread_pool_t* pool = (thread_pool_t*)arg;
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
 
-    while (1) {
-        pthread_mutex_lock(&pool->mutex);
-        //entering critical region
-        
-        // Wait while queue empty and not shutting down
-        while (!pool->shutdown && pool->head == NULL) {
-            pthread_cond_wait(&pool->cond, &pool->mutex);
+static uint64_t isqrt(uint64_t x) {
+    uint64_t r = 0, bit = 1ULL << 62;
+    while (bit > x) bit >>= 2;
+    while (bit) {
+        if (x >= r + bit) {
+            x -= r + bit;
+            r = (r >> 1) + bit;
+        } else {
+            r >>= 1;
         }
+        bit >>= 2;
+    }
+    return r;
+}
 
-        // If shutdown requested and queue empty: exit
-        if (pool->shutdown && pool->head == NULL) {
-            pthread_mutex_lock(&print_mutex);
-            printf("[THREAD_POOL] thread %lu shutting down\n",
-                   (unsigned long)pthread_self()); //print for logging
-            pthread_mutex_unlock(&print_mutex);
+// CoDel control law: the next shed comes interval/sqrt(count) after t
+static uint64_t control_law(thread_pool_t* pool, uint64_t t) {
+    return t + pool->interval_ns / isqrt(pool->drop_count);
+}
 
-            pthread_mutex_unlock(&pool->mutex);
-            break;
-        }
+// CoDel (Nichols/Jacobson, RFC 8289) on the time an fd spent in the queue: a short burst is fine,
+// but if even the fastest fds wait longer than target for a whole interval the queue is not
+// draining and we start shedding, faster and faster until the delay goes back under target.
+// Called by the thread that just took the fd, 1 = answer it with a 503
+static int should_shed(thread_pool_t* pool, uint64_t enqueued) {
+    uint64_t now = now_ns();
+    uint64_t sojourn = now > enqueued ? now - enqueued : 0;
+    if (sojourn >= pool->deadline_ns) return 1; // way too late, dont even read it
+    if (sojourn < pool->target_ns && !atomic_load_explicit(&pool->codel_active, memory_order_relaxed))
+        return 0; // the normal case, no lock
+
+    int shed = 0, ok_to_drop = 0;
+    pthread_mutex_lock(&pool->codel_mutex);
+    if (sojourn < pool->target_ns || fd_queue_length(&pool->queue) == 0) {
+        pool->first_above = 0; // under target or we just emptied it: no standing queue
+    } else if (pool->first_above == 0) {
+        pool->first_above = now + pool->interval_ns;
+    } else if (now >= pool->first_above) {
+        ok_to_drop = 1;
+    }
 
-        //pop a work item from the queue
-        work_item_t* item = pool->head;
-        if (item) {
-            pool->head = item->next; //update  head pointer to next item
-            if (pool->head == NULL) { 
-                pool->tail = NULL; 
-            }
+    if (pool->dropping) {
+        if (!ok_to_drop) {
+            pool->dropping = 0;
+        } else if (now >= pool->drop_next) {
+            shed = 1;
+            pool->drop_count++;
+            pool->drop_next = control_law(pool, pool->drop_next);
         }
+    } else if (ok_to_drop) {
+        shed = 1;
+        pool->dropping = 1;
+        // overloaded again soon after the last episode: resume near the rate it had
+        int64_t since = (int64_t)(now - pool->drop_next);
+        pool->drop_count = (pool->drop_count > 2 && since < (int64_t)(16 * pool->interval_ns)) ? pool->drop_count - 2 : 1;
+        pool->drop_next = control_law(pool, now);
+    }
+    atomic_store_explicit(&pool->codel_active, pool->first_above != 0 || pool->dropping, memory_order_relaxed);
+    pthread_mutex_unlock(&pool->codel_mutex);
+    return shed;
+}
 
-        pthread_mutex_unlock(&pool->mutex);
-        //exiting critical region
-
-        if (item) {
-            int client_fd = item->client_fd;
+// 503 and close, before anything was read from it (so no file I/O is spent on it either)
+static void shed_connection(int client_fd) {
+    send_503(client_fd);
+    conn_drop(client_fd); // also frees the state of a keep-alive connection
+    if (g_shared) stats_record_shed(g_shared);
+}
 
-            pthread_mutex_lock(&print_mutex);
-            printf("[THREAD_POOL] thread %lu handling client_fd=%d\n",
-                   (unsigned long)pthread_self(), client_fd);
-            pthread_mutex_unlock(&print_mutex);
+void* worker_thread(void* arg) {
+    thread_pool_t* pool = (thread_pool_t*)arg;
 
-            extern void handle_client(int client_fd, shared_data_t* shared, semaphores_t* sems);
-            extern shared_data_t* g_shared; // global shared data pointer(idea to use this was from copilot)
-            extern semaphores_t* g_sems; // global semaphores pointer
-            handle_client(client_fd, g_shared, g_sems);
+    while (1) {
+        // sleeps on the futex while the ring is empty, -1 once the pool is shutting down
+        uint64_t enqueued;
+        int client_fd = fd_queue_pop(&pool->queue, &enqueued);
+        if (client_fd < 0) {
+            LOG_INFO("[THREAD_POOL] thread %lu shutting down",
+                     (unsigned long)pthread_self()); //print for logging
+            break;
+        }
 
-            close(client_fd); // Only close here after handle_client is finished
+        if (should_shed(pool, enqueued)) {
+            shed_connection(client_fd);
+            continue;
+        }
 
-            free(item);
+        LOG_DEBUG("[THREAD_POOL] thread %lu handling client_fd=%d",
+                  (unsigned long)pthread_self(), client_fd);
+
+        extern int handle_client(conn_t* c);
+        conn_t* c = conn_get(client_fd);
+        if (c && TRACE_ON()) trace_queue(&c->resp.trace, enqueued);
+        if (!c) {
+            conn_drop(client_fd);
+        } else if (handle_client(c)) {
+            conn_park(c); // keep-alive: wait for the next request without holding this thread
+        } else {
+            conn_close(c); // Only close here after handle_client is finished
         }
     }
     return NULL;
 }
 
-thread_pool_t* create_thread_pool(int num_threads) {
-    thread_pool_t* pool = malloc(sizeof(thread_pool_t));
+thread_pool_t* create_thread_pool(int num_threads, const server_config_t* config) {
+    thread_pool_t* pool = aligned_alloc(64, sizeof(thread_pool_t)); // queue counters on their own cache lines
     if (!pool) {
         return NULL;
     }
+    // an fd is in the ring at most once (a connection is either queued, being handled or parked),
+    // so with room for every fd the process can have open the push never finds it full
+    size_t capacity = 1024;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur > capacity)
+        capacity = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > CONN_MAX_FDS) ? CONN_MAX_FDS : rl.rlim_cur;
+    if (fd_queue_init(&pool->queue, capacity) != 0) {
+        free(pool);
+        return NULL;
+    }
     pool->threads = malloc(sizeof(pthread_t) * num_threads);
     if (!pool->threads) {
+        fd_queue_destroy(&pool->queue);
         free(pool);
         return NULL;
     }
     pool->num_threads = num_threads;
-    pool->shutdown = 0;
-    //making sure queue is empty at start
-    pool->head = NULL;
-    pool->tail = NULL;
 
-    pthread_mutex_init(&pool->mutex, NULL); // Mutex to protect the work queue
-    pthread_cond_init(&pool->cond, NULL); // Condition variable for signaling work
+    int max_queue = config->max_queue_size > 0 ? config->max_queue_size : MAX_QUEUE_SIZE;
+    int target = config->queue_target_ms > 0 ? config->queue_target_ms : DEFAULT_QUEUE_TARGET_MS;
+    int interval = config->queue_interval_ms > 0 ? config->queue_interval_ms : DEFAULT_QUEUE_INTERVAL_MS;
+    int deadline = config->queue_deadline_ms > 0 ? config->queue_deadline_ms : DEFAULT_QUEUE_DEADLINE_MS;
+    pool->max_queue = (size_t)max_queue;
+    pool->target_ns = (uint64_t)target * 1000000ULL;
+    pool->interval_ns = (uint64_t)interval * 1000000ULL;
+    pool->deadline_ns = (uint64_t)deadline * 1000000ULL;
+    pthread_mutex_init(&pool->codel_mutex, NULL);
+    atomic_init(&pool->codel_active, 0);
+    pool->first_above = 0;
+    pool->drop_next = 0;
+    pool->drop_count = 0;
+    pool->dropping = 0;
 
     for (int i = 0; i < num_threads; i++) {
         if (pthread_create(&pool->threads[i], NULL, worker_thread, pool) == 0) {
-            pthread_mutex_lock(&print_mutex);
-            printf("[THREAD_POOL] thread %d created (pthread id: %lu)\n",
-                   i, (unsigned long)pool->threads[i]);
-            pthread_mutex_unlock(&print_mutex);
+            LOG_INFO("[THREAD_POOL] thread %d created (pthread id: %lu)",
+                     i, (unsigned long)pool->threads[i]);
         }
     }
 
@@ -98,66 +174,42 @@ thread_pool_t* create_thread_pool(int num_threads) {
 void thread_addFd(thread_pool_t* pool, int client_fd) {
     //debugging 
     if (!pool) {
-        close(client_fd);
+        conn_drop(client_fd);
         return;
     }
 
-    work_item_t* item = malloc(sizeof(work_item_t));
-    if (!item) {
-        close(client_fd);
+    // full: 503 now instead of making it wait behind everyone else
+    // (the ring itself has room for every fd, the bound is MAX_QUEUE_SIZE)
+    if (fd_queue_length(&pool->queue) >= pool->max_queue) {
+        shed_connection(client_fd);
         return;
     }
-    item->client_fd = client_fd;
-    item->next = NULL;
-
-    pthread_mutex_lock(&pool->mutex);
-
-    //entering critical region
-    if (pool->tail == NULL) {
-        // Queue was empty
-        //so now both head and tail point to the new item because its only one
-        pool->head = pool->tail = item;
-    } else { //if not empty
-        // Append to the end and update tail pointer(check if correct)
-        pool->tail->next = item;
-        pool->tail = item;
-    }
-
-    pthread_mutex_lock(&print_mutex);
-    printf("[THREAD_POOL] Enqueued work item: client_fd=%d\n", client_fd);
-    pthread_mutex_unlock(&print_mutex);
 
-    pthread_cond_signal(&pool->cond); // Wake one sleeping worker
-    pthread_mutex_unlock(&pool->mutex); //exiting critical region
+    // no lock and no allocation, a sleeping thread is woken only if there is one
+    if (fd_queue_push(&pool->queue, client_fd, now_ns()) != 0) {
+        shed_connection(client_fd);
+    }
 }
 
 void destroy_thread_pool(thread_pool_t* pool) {
     if (!pool) return;
     
-    pthread_mutex_lock(&pool->mutex); //entered critical region
-    pool->shutdown = 1;
-    pthread_cond_broadcast(&pool->cond); // Wake all threads
-    pthread_mutex_unlock(&pool->mutex); //exiting critical region
+    fd_queue_close(&pool->queue); // Wake all threads
 
     for (int i = 0; i < pool->num_threads; i++) {
         pthread_join(pool->threads[i], NULL);
-        pthread_mutex_lock(&print_mutex);
-        printf("[THREAD_POOL] Joined worker thread %d (pthread id: %lu)\n",
-               i, (unsigned long)pool->threads[i]);
-        pthread_mutex_unlock(&print_mutex);
+        LOG_INFO("[THREAD_POOL] Joined worker thread %d (pthread id: %lu)",
+                 i, (unsigned long)pool->threads[i]);
     }
 
-    // Free work that is in q but not handled yet
-    work_item_t* cur = pool->head;
-    while (cur) {
-        work_item_t* next = cur->next;
-        close(cur->client_fd); // wasn't handled
-        free(cur);
-        cur = next;
+    // close the fds that are in q but not handled yet
+    int fd;
+    while (fd_queue_try_pop(&pool->queue, &fd, NULL)) {
+        conn_drop(fd); // wasn't handled
     }
 
-    pthread_mutex_destroy(&pool->mutex);
-    pthread_cond_destroy(&pool->cond);
+    fd_queue_destroy(&pool->queue);
+    pthread_mutex_destroy(&pool->codel_mutex);
     free(pool->threads);
     free(pool); //for memory leaks free all memory alocated
 
@@ -3,29 +3,35 @@
 #define THREAD_POOL_H
 
 #include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "fd_queue.h"
+#include "config.h"
 
 
-// Simple work item structure (fd to handle + next pointer)
-typedef struct work_item {
-    int client_fd;                 
-    struct work_item* next;        
-} work_item_t;
-
-
+// Pool of threads that take client fds from a lock-free ring (no malloc and no mutex per fd).
+// The queue is bounded (MAX_QUEUE_SIZE) and shed with CoDel: when fds keep waiting longer than
+// the target, some of them get a 503 before anything is read so the rest are served in time
 typedef struct {
+    fd_queue_t queue;              // first: aligned_alloc keeps its cache line alignment
     pthread_t* threads;            
     int num_threads;               
-    pthread_mutex_t mutex;         // Mutex to protect the work queue
-    pthread_cond_t cond;           // Condition variable for signaling work
-    int shutdown;                  
-
-    // Work queue
-    work_item_t* head;             // Start 
-    work_item_t* tail;             // End
+    size_t max_queue;              // fds waiting, past this a new one is shed right away
+    uint64_t target_ns;            // CoDel target / interval and the hard deadline (see config.h)
+    uint64_t interval_ns;
+    uint64_t deadline_ns;
+    // CoDel state, under codel_mutex. While codel_active is 0 (queue delay under target) the
+    // threads dont take the mutex at all
+    pthread_mutex_t codel_mutex;
+    atomic_int codel_active;
+    uint64_t first_above;          // when the delay will have been above target for a whole interval (0: it is not)
+    uint64_t drop_next;            // next shed while dropping
+    unsigned int drop_count;       // sheds in this episode, the rate grows with its square root
+    int dropping;
 } thread_pool_t;
 
 
-thread_pool_t* create_thread_pool(int num_threads);
+thread_pool_t* create_thread_pool(int num_threads, const server_config_t* config);
 
 
 void destroy_thread_pool(thread_pool_t* pool);
@@ -33,4 +39,4 @@ void destroy_thread_pool(thread_pool_t* pool);
 
 void thread_addFd(thread_pool_t* pool, int client_fd);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,206 @@
+// trace.c
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+int g_trace_enabled = 0;
+
+typedef struct {
+    uint64_t start;
+    uint64_t total;
+    uint64_t ns[TRACE_PHASES];
+    int status;
+    char path[64];
+} trace_record_t;
+
+// Written only by its thread, read by the dump: each record has a sequence number that is odd
+// while it is being written, a reader that sees it odd or changed skips the record
+typedef struct trace_ring {
+    atomic_uint seq[TRACE_RING_SIZE];
+    trace_record_t records[TRACE_RING_SIZE];
+    atomic_size_t count;            // records written so far (the slot is count % TRACE_RING_SIZE)
+    int thread;                     // number in the dump
+    struct trace_ring* next;
+} trace_ring_t;
+
+static _Atomic(trace_ring_t*) g_rings;
+static atomic_int g_nrings;
+static _Thread_local trace_ring_t* t_ring;
+
+static const char* phase_names[TRACE_PHASES] = {
+    "queue", "wait", "recv", "parse", "open", "read", "send", "stats", "log"
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void trace_reset(request_trace_t* t) {
+    memset(t, 0, sizeof(*t));
+}
+
+void trace_begin(request_trace_t* t) {
+    if (t->start == 0) t->start = t->last = now_ns();
+}
+
+void trace_mark(request_trace_t* t, int phase) {
+    uint64_t now = now_ns();
+    if (t->start == 0) {
+        t->start = t->last = now;
+        return;
+    }
+    t->ns[phase] += now - t->last;
+    t->last = now;
+}
+
+void trace_queue(request_trace_t* t, uint64_t enqueued_ns) {
+    uint64_t now = now_ns();
+    if (t->start == 0) t->start = enqueued_ns;
+    else if (enqueued_ns > t->last) t->ns[TRACE_WAIT] += enqueued_ns - t->last; // parked with half a request
+    t->ns[TRACE_QUEUE] += now > enqueued_ns ? now - enqueued_ns : 0;
+    t->last = now;
+}
+
+void trace_resume(request_trace_t* t) {
+    trace_mark(t, TRACE_WAIT);
+}
+
+static trace_ring_t* ring_create(void) {
+    trace_ring_t* r = calloc(1, sizeof(trace_ring_t));
+    if (!r) return NULL;
+    r->thread = atomic_fetch_add_explicit(&g_nrings, 1, memory_order_relaxed);
+    trace_ring_t* first = atomic_load_explicit(&g_rings, memory_order_relaxed);
+    do {
+        r->next = first;
+    } while (!atomic_compare_exchange_weak_explicit(&g_rings, &first, r, memory_order_release, memory_order_relaxed));
+    t_ring = r;
+    return r;
+}
+
+void trace_end(request_trace_t* t, int status, const char* path) {
+    trace_ring_t* r = t_ring ? t_ring : ring_create();
+    if (r && t->start != 0) {
+        size_t n = atomic_load_explicit(&r->count, memory_order_relaxed);
+        size_t i = n % TRACE_RING_SIZE;
+        unsigned seq = atomic_load_explicit(&r->seq[i], memory_order_relaxed);
+        atomic_store_explicit(&r->seq[i], seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        trace_record_t* rec = &r->records[i];
+        rec->start = t->start;
+        rec->total = t->last - t->start;
+        memcpy(rec->ns, t->ns, sizeof(rec->ns));
+        rec->status = status;
+        snprintf(rec->path, sizeof(rec->path), "%s", path);
+        atomic_store_explicit(&r->seq[i], seq + 2, memory_order_release);
+        atomic_store_explicit(&r->count, n + 1, memory_order_release);
+    }
+    trace_reset(t);
+}
+
+typedef struct {
+    trace_record_t rec;
+    int thread;
+} dump_entry_t;
+
+static int slowest_first(const void* a, const void* b) {
+    uint64_t ta = ((const dump_entry_t*)a)->rec.total, tb = ((const dump_entry_t*)b)->rec.total;
+    return (ta < tb) - (ta > tb);
+}
+
+char* trace_dump(size_t* len) {
+    size_t max = (size_t)atomic_load_explicit(&g_nrings, memory_order_relaxed) * TRACE_RING_SIZE;
+    dump_entry_t* entries = malloc(sizeof(dump_entry_t) * (max ? max : 1));
+    size_t n = 0;
+    if (!entries) return NULL;
+
+    for (trace_ring_t* r = atomic_load_explicit(&g_rings, memory_order_acquire); r && n < max; r = r->next) {
+        size_t count = atomic_load_explicit(&r->count, memory_order_acquire);
+        size_t have = count < TRACE_RING_SIZE ? count : TRACE_RING_SIZE;
+        for (size_t k = 0; k < have && n < max; k++) {
+            unsigned before = atomic_load_explicit(&r->seq[k], memory_order_acquire);
+            if (before & 1) continue; // being written
+            entries[n].rec = r->records[k];
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&r->seq[k], memory_order_relaxed) != before) continue; // overwritten meanwhile
+            entries[n].thread = r->thread;
+            n++;
+        }
+    }
+    qsort(entries, n, sizeof(dump_entry_t), slowest_first);
+
+    size_t size = 256 + n * 192;
+    char* out = malloc(size);
+    if (!out) {
+        free(entries);
+        return NULL;
+    }
+    size_t used = (size_t)snprintf(out, size, "# worker %d: last %d requests per thread, slowest first, times in us\n"
+                                              "# thread start_ms total", (int)getpid(), TRACE_RING_SIZE);
+    for (int p = 0; p < TRACE_PHASES; p++) used += (size_t)snprintf(out + used, size - used, " %s", phase_names[p]);
+    used += (size_t)snprintf(out + used, size - used, " status path\n");
+    for (size_t i = 0; i < n && used < size; i++) {
+        const trace_record_t* rec = &entries[i].rec;
+        used += (size_t)snprintf(out + used, size - used, "%d %llu %llu", entries[i].thread,
+                                 (unsigned long long)(rec->start / 1000000), (unsigned long long)(rec->total / 1000));
+        for (int p = 0; p < TRACE_PHASES && used < size; p++)
+            used += (size_t)snprintf(out + used, size - used, " %llu", (unsigned long long)(rec->ns[p] / 1000));
+        if (used < size) used += (size_t)snprintf(out + used, size - used, " %d %s\n", rec->status, rec->path);
+    }
+    free(entries);
+    *len = used < size ? used : size - 1;
+    return out;
+}
+
+static void* dumper(void* arg) {
+    sigset_t* set = arg;
+    while (1) {
+        int sig;
+        if (sigwait(set, &sig) != 0) continue;
+        size_t len;
+        char* text = trace_dump(&len);
+        if (!text) continue;
+        char name[64];
+        snprintf(name, sizeof(name), "trace_%d.txt", (int)getpid());
+        FILE* f = fopen(name, "w");
+        if (f) {
+            fwrite(text, 1, len, f);
+            fclose(f);
+        }
+        free(text);
+    }
+    return NULL;
+}
+
+void trace_init(int enabled) {
+    g_trace_enabled = enabled;
+    if (!enabled) {
+        signal(SIGUSR1, SIG_IGN); // a stray "kill -USR1" must not end the worker
+        return;
+    }
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    signal(SIGUSR1, SIG_DFL); // ignored signals are dropped even when blocked
+
+    // like the log flusher, the dumper starts with everything blocked and only sigwaits for its own
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, dumper, &set);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        signal(SIGUSR1, SIG_IGN);
+        return;
+    }
+    pthread_detach(tid);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
@@ -0,0 +1,62 @@
+// trace.h
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Phases of a request (TRACE_REQUESTS=1). Each one gets the time since the previous mark
+enum {
+    TRACE_QUEUE,    // waiting in the thread pool queue
+    TRACE_WAIT,     // waiting for the client between reads/writes (rest of the request not there yet, socket full)
+    TRACE_RECV,
+    TRACE_PARSE,    // http_parser_run on the bytes that completed the header
+    TRACE_OPEN,     // request checks, cache lookup, open, fstat
+    TRACE_READ,     // reading the file into memory (and cache_put)
+    TRACE_SEND,
+    TRACE_STATS,
+    TRACE_LOG,
+    TRACE_PHASES
+};
+
+#define TRACE_RING_SIZE 256     // last requests kept per thread
+#define TRACE_URL "/server-stats/trace" // the rings of the worker that answers it
+
+// Timing of the request in progress, lives in its http_response_t
+typedef struct {
+    uint64_t start;             // monotonic ns, 0 = nothing started yet
+    uint64_t last;              // last mark
+    uint64_t ns[TRACE_PHASES];
+} request_trace_t;
+
+extern int g_trace_enabled;
+
+// the only cost with tracing off is this branch
+#define TRACE_ON() __builtin_expect(g_trace_enabled, 0)
+#define TRACE_MARK(t, phase) do { if (TRACE_ON()) trace_mark((t), (phase)); } while (0)
+
+// Called by each worker before it starts its threads. Enabled, SIGUSR1 writes every thread's ring
+// to trace_<pid>.txt (a thread waits for it, the others have it blocked), disabled it is ignored
+void trace_init(int enabled);
+
+void trace_reset(request_trace_t* t);
+
+// time since the last mark goes to phase (the first mark just starts the request)
+void trace_mark(request_trace_t* t, int phase);
+
+// starts the request at its first byte if it wasnt started yet
+void trace_begin(request_trace_t* t);
+
+// popped from the pool queue where it was put at enqueued_ns
+void trace_queue(request_trace_t* t, uint64_t enqueued_ns);
+
+// an event loop picks the connection up again: the gap was spent waiting for the client
+void trace_resume(request_trace_t* t);
+
+// the request is done: stored in this thread's ring and t reset for the next one
+void trace_end(request_trace_t* t, int status, const char* path);
+
+// Text dump of every ring of this process, slowest requests first (malloc'd, *len set)
+char* trace_dump(size_t* len);
+
+#endif
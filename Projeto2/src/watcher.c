@@ -0,0 +1,243 @@
+// watcher.c
+#define _GNU_SOURCE // d_type
+#include "watcher.h"
+#include "fd_cache.h"
+#include "gzip.h"
+#include "http.h"
+#include "logger.h"
+#include "worker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+// Paths are built like build_response builds them (root + "/" + path under it) so they are the
+// same strings the caches use as keys
+typedef struct {
+    int wd;
+    char* path;
+} watch_t;
+
+static int g_fd = -1;
+static file_cache_t* g_cache;
+static size_t g_max_size;
+static int g_reload;
+static watch_t* g_watches;  // only the watcher thread touches them after watcher_start
+static size_t g_nwatches;
+static size_t g_cap;
+
+static const char* watch_path(int wd) {
+    for (size_t i = 0; i < g_nwatches; i++)
+        if (g_watches[i].wd == wd) return g_watches[i].path;
+    return NULL;
+}
+
+static void forget_watch(size_t i) {
+    free(g_watches[i].path);
+    g_watches[i] = g_watches[--g_nwatches];
+}
+
+static void add_watch(const char* path) {
+    int wd = inotify_add_watch(g_fd, path, WATCH_MASK);
+    if (wd < 0) {
+        LOG_WARN("inotify_add_watch %s: %s", path, strerror(errno));
+        return;
+    }
+    for (size_t i = 0; i < g_nwatches; i++) {
+        if (g_watches[i].wd == wd) { // same directory under a new name
+            char* copy = strdup(path);
+            if (copy) {
+                free(g_watches[i].path);
+                g_watches[i].path = copy;
+            }
+            return;
+        }
+    }
+    if (g_nwatches == g_cap) {
+        size_t cap = g_cap ? g_cap * 2 : 16;
+        watch_t* w = realloc(g_watches, cap * sizeof(watch_t));
+        if (!w) return;
+        g_watches = w;
+        g_cap = cap;
+    }
+    g_watches[g_nwatches].path = strdup(path);
+    if (!g_watches[g_nwatches].path) return;
+    g_watches[g_nwatches++].wd = wd;
+}
+
+// path and every directory under it (symlinks are not followed)
+static void add_tree(const char* path) {
+    add_watch(path);
+    DIR* dir = opendir(path);
+    if (!dir) return;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char sub[1024];
+        snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+        struct stat st;
+        int is_dir = de->d_type == DT_DIR ||
+                     (de->d_type == DT_UNKNOWN && lstat(sub, &st) == 0 && S_ISDIR(st.st_mode));
+        if (is_dir) add_tree(sub);
+    }
+    closedir(dir);
+}
+
+// a directory moved away: its watches (and the ones below it) would report the old names
+static void forget_tree(const char* path) {
+    size_t len = strlen(path);
+    for (size_t i = 0; i < g_nwatches;) {
+        const char* p = g_watches[i].path;
+        if (strncmp(p, path, len) == 0 && (p[len] == '\0' || p[len] == '/')) {
+            inotify_rm_watch(g_fd, g_watches[i].wd);
+            forget_watch(i);
+        } else {
+            i++;
+        }
+    }
+}
+
+// read the new version of a file that was cached and put it back (same limits as build_response)
+static void refresh(const char* path) {
+    unsigned long generation = cache_generation(g_cache, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (size_t)st.st_size >= g_max_size) {
+        close(fd);
+        return;
+    }
+    size_t sz = (size_t)st.st_size;
+    char* contents = malloc(sz);
+    size_t got = 0;
+    while (contents && got < sz) {
+        ssize_t n = read(fd, contents + got, sz - got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    close(fd);
+    if (!contents || got != sz) {
+        free(contents);
+        return;
+    }
+    file_validators_t validators;
+    http_file_validators(&st, &validators);
+    size_t gz_size = 0;
+    unsigned char* gz = gzip_variant(get_mime_type(path), (unsigned char*)contents, sz, &gz_size);
+    cache_entry_t* entry = cache_put(g_cache, path, (unsigned char*)contents, sz, &validators, gz, gz_size, generation);
+    if (entry) {
+        cache_release(entry);
+    } else {
+        free(contents);
+        free(gz);
+    }
+    LOG_DEBUG("watcher: %s reloaded into the cache", path);
+}
+
+// 1 if the cached entry of path was read from the file that is there now (same etag)
+static int current(const char* path) {
+    cache_entry_t* entry = cache_get(g_cache, path);
+    if (!entry) return 0;
+    struct stat st;
+    file_validators_t v;
+    int same = stat(path, &st) == 0 && (http_file_validators(&st, &v), strcmp(v.etag, entry->validators.etag) == 0);
+    cache_release(entry);
+    return same;
+}
+
+static void handle_event(const struct inotify_event* ev) {
+    if (ev->mask & IN_Q_OVERFLOW) { // events were lost, anything may have changed
+        LOG_WARN("watcher: inotify queue overflow, dropping the caches");
+        fd_cache_invalidate_all();
+        cache_invalidate_all(g_cache);
+        return;
+    }
+    if (ev->mask & IN_IGNORED) { // watch removed (directory deleted, or by forget_tree)
+        for (size_t i = 0; i < g_nwatches; i++) {
+            if (g_watches[i].wd == ev->wd) {
+                forget_watch(i);
+                break;
+            }
+        }
+        return;
+    }
+    const char* dir = watch_path(ev->wd);
+    if (!dir) return;
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) { // a watched directory itself (the root has no parent to tell)
+        fd_cache_invalidate_all();
+        cache_invalidate_all(g_cache);
+        return;
+    }
+    if (ev->len == 0) return;
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+    if (ev->mask & IN_ISDIR) {
+        // a directory came, went or was renamed: every path under it changed with it
+        if (ev->mask & IN_MOVED_FROM) forget_tree(path);
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) add_tree(path);
+        fd_cache_invalidate_all();
+        cache_invalidate_all(g_cache);
+        LOG_DEBUG("watcher: directory %s changed, caches dropped", path);
+        return;
+    }
+
+    // fd cache first: a request that sees the new cache generation must not get the old fd back
+    fd_cache_invalidate(path); // also a "not found" that now exists
+    if (!g_reload && current(path)) return; // the reloading worker already put the new version there
+    int cached = cache_invalidate(g_cache, path);
+    // written and closed, or a new version renamed over it (how deploys usually do it). A touch or
+    // a chmod only drops it, the next request reads it (or gets its 403) like any miss
+    if (g_reload && cached && (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))) refresh(path);
+}
+
+static void* watcher_run(void* arg) {
+    (void)arg;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(g_fd, buf, sizeof(buf));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            LOG_ERROR("watcher read: %s", strerror(errno));
+            return NULL;
+        }
+        for (char* p = buf; p < buf + n;) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            handle_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return NULL;
+}
+
+int watcher_start(const char* document_root, file_cache_t* cache, size_t max_size, int reload) {
+    g_fd = inotify_init1(IN_CLOEXEC);
+    if (g_fd < 0) return -1;
+    g_cache = cache;
+    g_max_size = max_size;
+    g_reload = reload;
+    add_tree(document_root);
+    if (g_nwatches == 0) {
+        close(g_fd);
+        return -1;
+    }
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, watcher_run, NULL) != 0) {
+        close(g_fd);
+        return -1;
+    }
+    pthread_detach(tid);
+    LOG_DEBUG("watcher: %zu directories under %s", g_nwatches, document_root);
+    return 0;
+}
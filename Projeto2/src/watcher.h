@@ -0,0 +1,17 @@
+// watcher.h
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <stddef.h>
+#include "cache.h"
+
+// Start a thread (per worker) that watches document_root and every directory under it with
+// inotify. A file that changes, appears or goes away is dropped from the cache and the fd cache
+// right away; one that was cached is read again once its write is finished (or it was renamed over),
+// so a deploy needs no restart and leaves no cold cache. Files of max_size or more are not read
+// again (they are the ones sent with sendfile). With reload 0 files are only dropped, for the
+// workers of a shared cache (CACHE_MODE=shared) other than the one that reloads them.
+// Returns -1 if inotify is not available, cached files are then never reloaded
+int watcher_start(const char* document_root, file_cache_t* cache, size_t max_size, int reload);
+
+#endif
@@ -1,4 +1,5 @@
 // worker.c
+#define _GNU_SOURCE // cpu_set_t
 #include "worker.h"
 #include "shared_mem.h"
 #include "semaphores.h"
@@ -8,6 +9,14 @@
 #include "cache.h"
 #include "http.h"
 #include "logger.h"
+#include "conn.h"
+#include "event_loop.h"
+#include "dispatch.h"
+#include "trace.h"
+#include "error_pages.h"
+#include "fd_cache.h"
+#include "watcher.h"
+#include "gzip.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -18,14 +27,23 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sched.h>
 
 //all the global variables
 shared_data_t* g_shared;
 semaphores_t* g_sems;
 file_cache_t* g_cache;
 
-// Mutex global para prints
-pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+// files this big or bigger go out with sendfile instead of being read into memory
+static size_t g_sendfile_threshold = DEFAULT_SENDFILE_THRESHOLD_KB * 1024;
+
+// keep-alive: requests per connection and idle timeout
+static int g_keepalive_max = DEFAULT_KEEPALIVE_MAX;
+static int g_timeout = 30;
 
 static pthread_mutex_t docroot_mutex = PTHREAD_MUTEX_INITIALIZER;
 static char g_document_root[256] = {0};
@@ -42,58 +60,230 @@ const char* get_mime_type(const char* file_path) { //every file is by default a
     return "application/octet-stream";
 }
 
-// Helper to send a custom HTML error page if available, fallback to plain text if not
-void send_custom_error_page(
-    int client_fd, int status, const char* status_msg,
-    const char* document_root, const char* error_filename,
-    const char* fallback_msg, shared_data_t *shared, semaphores_t *sems
-) {
-    char error_file_path[512];
-    snprintf(error_file_path, sizeof(error_file_path), "%s/errors/%s", document_root, error_filename);
-
-    FILE* fp = fopen(error_file_path, "rb");
-    if (fp) {
-        fseek(fp, 0, SEEK_END);
-        long sz = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-        char* contents = malloc(sz);
-        if (contents && fread(contents, 1, sz, fp) == (size_t)sz) {
-            send_http_response(client_fd, status, status_msg, "text/html", contents, sz);
-            stats_record_response(shared, sems, status, sz);
-            log_request(sems->log_mutex, "127.0.0.1", "-", "-", status, sz);
-            free(contents);
-            fclose(fp);
-            return;
-        }
-        free(contents);
-        fclose(fp);
+// Helper to build a custom HTML error page response if available, fallback to plain text if not
+// Error pages are rendered once per worker (error_pages.c): the header is just the status line and
+// Date, the rest of the headers go with the page as the body, so it all goes out with one send
+static void build_error_response(http_response_t* resp, int status, const char* status_msg, int keep_alive) {
+    const error_page_t* page = error_pages_get(status, keep_alive, &resp->errors);
+    if (!page) { // no memory for them: headers only
+        http_response_set_header(resp, status, status_msg, "text/plain", 0, keep_alive);
+        return;
+    }
+    resp->header_len = http_status_lines(resp->header, sizeof(resp->header), status, status_msg);
+    resp->body = page->data;
+    resp->body_len = page->len;
+    resp->stats_bytes = page->len - page->header_len;
+    resp->log_bytes = page->len - page->header_len;
+    resp->keep_alive = keep_alive;
+    resp->status = status;
+}
+
+// validators, and Vary on the types that have a gzip variant so a shared cache keeps them apart
+static void add_validators(http_response_t* resp, const char* mime, const file_validators_t* v) {
+    if (gzip_compressible(mime)) http_response_add_header(resp, "Vary", "Accept-Encoding");
+    if (v->etag[0] == '\0') return;
+    http_response_add_header(resp, "ETag", v->etag);
+    http_response_add_header(resp, "Last-Modified", v->last_modified);
+}
+
+// 200 headers for a file, with its validators so the next request can be a conditional one
+static void set_file_header(http_response_t* resp, const char* mime, size_t size,
+                            const file_validators_t* v, int keep_alive) {
+    http_response_set_header(resp, 200, "OK", mime, size, keep_alive);
+    http_response_add_header(resp, "Accept-Ranges", "bytes");
+    add_validators(resp, mime, v);
+}
+
+// The client already has this version: same headers a 200 would have (Content-Length included,
+// RFC 7230 allows it when it is the real length) and no body
+static void build_not_modified(http_response_t* resp, const char* mime, size_t size,
+                               const file_validators_t* v, int keep_alive) {
+    http_response_set_header(resp, 304, "Not Modified", mime, size, keep_alive);
+    add_validators(resp, mime, v);
+}
+
+// gzip is only sent whole: a range asks for bytes of the plain file
+static int wants_gzip(const http_request_t* req, const char* mime) {
+    return !req->range.ptr && gzip_compressible(mime) && gzip_accepted(&req->accept_encoding);
+}
+
+// the gzip variant is another representation and needs its own strong ETag ("...-gz")
+static void gzip_validators(const file_validators_t* v, file_validators_t* out) {
+    *out = *v;
+    size_t len = strlen(v->etag);
+    if (len >= 2 && len + 3 < sizeof(out->etag)) memcpy(out->etag + len - 1, "-gz\"", 5);
+}
+
+// Headers of a gzip variant (cached or a .gz file). Returns 1 if the client has it already and
+// they are a 304
+static int set_gzip_header(http_response_t* resp, const http_request_t* req, const char* mime,
+                           size_t size, const file_validators_t* v, int keep_alive) {
+    int not_modified = http_not_modified(req, v);
+    if (not_modified) http_response_set_header(resp, 304, "Not Modified", mime, size, keep_alive);
+    else http_response_set_header(resp, 200, "OK", mime, size, keep_alive);
+    http_response_add_header(resp, "Content-Encoding", "gzip");
+    add_validators(resp, mime, v);
+    return not_modified;
+}
+
+// Ranges of a file of size bytes the request wants: -1 the whole file (no Range, one we ignore, or
+// an If-Range for another version of the file), 0 if none of them is inside the file (416)
+static int wanted_ranges(const http_request_t* req, size_t size, const file_validators_t* v,
+                         http_range_t* ranges) {
+    if (!req->range.ptr) return -1;
+    if (req->if_range.ptr && (v->etag[0] == '\0' || (strcmp(req->if_range.ptr, v->etag) != 0 &&
+                                                      strcmp(req->if_range.ptr, v->last_modified) != 0)))
+        return -1;
+    return http_parse_ranges(&req->range, size, ranges, HTTP_MAX_RANGES);
+}
+
+static void build_range_not_satisfiable(http_response_t* resp, size_t size, int keep_alive) {
+    build_error_response(resp, 416, "Range Not Satisfiable", keep_alive);
+    // the only error with a header that changes: its pre-rendered headers are copied where one
+    // more can be added, the body is still sent from the page
+    size_t header_len = resp->body_len - resp->stats_bytes;
+    if (resp->errors && resp->header_len + header_len < sizeof(resp->header)) {
+        memcpy(resp->header + resp->header_len, resp->body, header_len);
+        resp->header_len += header_len;
+        resp->body += header_len;
+        resp->body_len -= header_len;
     }
-    // Fallback: send plain text message
-    send_http_response(client_fd, status, status_msg, "text/plain", fallback_msg, strlen(fallback_msg));
-    stats_record_response(shared, sems, status, strlen(fallback_msg));
-    log_request(sems->log_mutex, "127.0.0.1", "-", "-", status, strlen(fallback_msg));
+    char value[48];
+    snprintf(value, sizeof(value), "bytes */%zu", size);
+    http_response_add_header(resp, "Content-Range", value);
+}
+
+// 206 for ranges of the body already set in resp (cache entry or open file), -1 if there was no
+// memory for it and the whole file should go instead
+static int send_ranges(http_response_t* resp, const http_range_t* ranges, int nranges, const char* mime,
+                       size_t size, const file_validators_t* v, int is_head, int keep_alive) {
+    if (http_response_set_ranges(resp, ranges, nranges, mime, size, keep_alive) != 0) return -1;
+    add_validators(resp, mime, v);
+    resp->stats_bytes = resp->body_len;
+    resp->log_bytes = resp->body_len;
+    if (is_head) resp->body_len = 0;
+    return 0;
 }
 
-// CONSUMER: gets a client_fd from the shared circular buffer
-static int dequeue_connection(shared_data_t* data, semaphores_t* sems) {
-    int client_fd;
+size_t worker_render_headers(const cache_entry_t* entry, char* out, size_t max) {
+    const char* mime = get_mime_type(entry->path);
+    const char* vary = gzip_compressible(mime) ? "Vary: Accept-Encoding\r\n" : "";
+    const file_validators_t* v = &entry->validators;
+    char validators[160] = "";
+    if (v->etag[0] != '\0')
+        snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n", v->etag, v->last_modified);
+    // same lines set_file_header writes
+    int n = snprintf(out, max, "Content-Type: %s\r\nContent-Length: %zu\r\nServer: " HTTP_SERVER "\r\n"
+                     "Accept-Ranges: bytes\r\n%s%s", mime, entry->size, vary, validators);
+    if (n <= 0 || (size_t)n + 1 >= max) return 0;
+    size_t len = (size_t)n + 1; // the '\0' is the end of the plain ones
+    out[n] = '\0';
+    if (!entry->gzip) return len;
+
+    file_validators_t gv;
+    gzip_validators(v, &gv);
+    validators[0] = '\0';
+    if (gv.etag[0] != '\0')
+        snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n", gv.etag, gv.last_modified);
+    // same lines set_gzip_header writes for a 200
+    n = snprintf(out + len, max - len, "Content-Type: %s\r\nContent-Length: %zu\r\nServer: " HTTP_SERVER "\r\n"
+                 "Content-Encoding: gzip\r\n%s%s", mime, entry->gzip_size, vary, validators);
+    if (n <= 0 || (size_t)n >= max - len) return len; // gzip ones are then built per request
+    return len + (size_t)n;
+}
 
-    // Wait until there is at least one filled slot
-    sem_wait(sems->filled_slots);
-    sem_wait(sems->queue_mutex);
+// Response from a cache entry (304, 416, ranges, gzip or the whole file), sent straight from the
+// shared data with no open and no copy. Takes over the reference on entry.
+// A 200 takes its headers from the entry (rendered when it was cached) when it has them
+static void send_entry(http_response_t* resp, const http_request_t* req, cache_entry_t* entry,
+                       const char* mime, int is_head, int keep) {
+    size_t plain_len = entry->headers ? strnlen(entry->headers, entry->headers_len) : 0;
+    if (entry->gzip && wants_gzip(req, mime)) {
+        file_validators_t v;
+        gzip_validators(&entry->validators, &v);
+        size_t gzip_len = entry->headers_len > plain_len + 1 ? entry->headers_len - plain_len - 1 : 0;
+        if (http_not_modified(req, &v)) {
+            set_gzip_header(resp, req, mime, entry->gzip_size, &v, keep);
+            cache_release(entry);
+            return;
+        }
+        if (gzip_len == 0 || http_response_set_rendered(resp, 200, "OK", entry->headers + plain_len + 1, gzip_len, keep) != 0)
+            set_gzip_header(resp, req, mime, entry->gzip_size, &v, keep);
+        resp->entry = entry;
+        resp->body = (const char*)entry->gzip;
+        resp->body_len = is_head ? 0 : entry->gzip_size;
+        resp->stats_bytes = entry->gzip_size;
+        resp->log_bytes = entry->gzip_size;
+        return;
+    }
+    if (http_not_modified(req, &entry->validators)) {
+        build_not_modified(resp, mime, entry->size, &entry->validators, keep);
+        cache_release(entry);
+        return;
+    }
+    http_range_t ranges[HTTP_MAX_RANGES];
+    int nranges = wanted_ranges(req, entry->size, &entry->validators, ranges);
+    if (nranges == 0) {
+        cache_release(entry);
+        build_range_not_satisfiable(resp, entry->size, keep);
+        return;
+    }
+    resp->entry = entry; // released when the response is freed, after the last byte went out
+    resp->body = (const char*)entry->data;
+    if (nranges > 0 && send_ranges(resp, ranges, nranges, mime, entry->size, &entry->validators, is_head, keep) == 0)
+        return;
+    if (plain_len == 0 || http_response_set_rendered(resp, 200, "OK", entry->headers, plain_len, keep) != 0)
+        set_file_header(resp, mime, entry->size, &entry->validators, keep);
+    resp->body_len = is_head ? 0 : entry->size; // HEAD still gets Content-Length test 12
+    resp->stats_bytes = entry->size;
+    resp->log_bytes = entry->size;
+}
 
-    //read from the circular buffer
-    client_fd = data->queue.sockets[data->queue.front];
-    data->queue.front = (data->queue.front + 1) % MAX_QUEUE_SIZE;
-    data->queue.count--;
+// A file that is not read into memory has no gzip variant of ours, a precompressed file.gz next to
+// it ("gzip -k" at deploy time) is sent instead. Returns 1 if it was (resp is ready)
+static int send_gz_file(http_response_t* resp, const http_request_t* req, const char* file_path,
+                        const open_file_t* file, const char* mime, int is_head, int keep) {
+    char gz_path[1040];
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", file_path);
+    open_file_t* gz = fd_cache_open(gz_path);
+    // an older one is what is left from the last version of the file
+    if (!gz || gz->fd < 0 || gz->size == 0 || gz->validators.mtime < file->validators.mtime) {
+        fd_cache_release(gz);
+        return 0;
+    }
+    if (set_gzip_header(resp, req, mime, gz->size, &gz->validators, keep)) {
+        fd_cache_release(gz);
+        return 1;
+    }
+    resp->file = gz; // released when the response is freed
+    resp->file_fd = gz->fd;
+    resp->body_len = is_head ? 0 : gz->size;
+    resp->stats_bytes = gz->size;
+    resp->log_bytes = gz->size;
+    return 1;
+}
 
-    sem_post(sems->queue_mutex);
-    sem_post(sems->empty_slots); //signal that there is one more empty slot
+void worker_file_path(const char* document_root, const char* path, char* out, size_t size) {
+    // "/a//b" is the same file as "/a/b": one cache key, and the one the watcher drops when it changes
+    char squeezed[512];
+    size_t n = 0;
+    for (const char* p = path; *p && n < sizeof(squeezed) - 1; p++)
+        if (*p != '/' || n == 0 || squeezed[n - 1] != '/') squeezed[n++] = *p;
+    squeezed[n] = '\0';
 
-    return client_fd;
+    // if a dir is requestred we put the index.html requested on test 11
+    if (n > 0 && squeezed[n - 1] == '/') { //so if a dir like / or /subdir/
+        snprintf(out, size, "%s%sindex.html", document_root, squeezed);
+    } else {
+        snprintf(out, size, "%s/%s", document_root, squeezed[0] == '/' ? squeezed + 1 : squeezed);
+    }
 }
 
-void handle_client(int client_fd, shared_data_t* shared, semaphores_t* sems) {
+// Works out the response to one parsed request without touching the socket, so the thread pool
+// and the event loops write it the same way.
+// resp->keep_alive says if the connection can stay open for the next request
+static void build_response(const http_request_t* req, int can_keep_alive, http_response_t* resp,
+                           shared_data_t* shared) {
    
     pthread_mutex_lock(&docroot_mutex);
     static char document_root[256] = {0};
@@ -103,7 +293,7 @@ void handle_client(int client_fd, shared_data_t* shared, semaphores_t* sems) {
             char line[256];
             while (fgets(line, sizeof(line), f)) {
                 if (strncmp(line, "DOCUMENT_ROOT=", 14) == 0) { // look for the document root line
-                    strncpy(document_root, line + 14, sizeof(document_root) - 1);
+                    snprintf(document_root, sizeof(document_root), "%s", line + 14);
                     size_t len = strlen(document_root);
                     if (len > 0 && document_root[len - 1] == '\n'){
                         document_root[len - 1] = '\0'; //if there is a newline at the end we remove
@@ -118,224 +308,421 @@ void handle_client(int client_fd, shared_data_t* shared, semaphores_t* sems) {
     pthread_mutex_unlock(&docroot_mutex); //solved the race condition
 
     
-    stats_increment_active(shared, sems);
-
-    
-    char buffer[2048] = {0};
-    ssize_t rlen = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-
-
-    const char *ip_str = "127.0.0.1";
-
-    if (rlen <= 0) {
-        pthread_mutex_lock(&print_mutex);
-        printf("[DEBUG] recv() failed: rlen=%zd, errno=%d\n", rlen, errno);
-        pthread_mutex_unlock(&print_mutex);
-
-        // logging recv error 400
-        log_request(sems->log_mutex, ip_str, "-", "-", 400, 0);
-
-        stats_decrement_active(shared, sems);
-        return;
-    }
-    buffer[rlen] = '\0'; //reset the buffer
-    pthread_mutex_lock(&print_mutex);
-    printf("[DEBUG] Received %zd bytes: %s\n", rlen, buffer);
-    pthread_mutex_unlock(&print_mutex);
+    stats_increment_active(shared); // decremented once the response is sent (worker_finish_response)
 
-    //parse the http request
-    http_request_t req;
-    if (parse_http_request(buffer, &req) != 0) {
-        pthread_mutex_lock(&print_mutex);
-        printf("[DEBUG] parse_http_request FAILED\n");
-        pthread_mutex_unlock(&print_mutex);
-        send_custom_error_page(client_fd, 400, "Bad Request", document_root, "error400.html", "400 Bad Request\n", shared, sems);
+    LOG_DEBUG("Request: %s %s %s (%zu header bytes)", req->method.ptr, req->path.ptr, req->version.ptr, req->header_len);
 
-        // Log bad request
-        log_request(sems->log_mutex, ip_str, "-", "-", 400, 0);
+    snprintf(resp->method, sizeof(resp->method), "%s", req->method.ptr);
+    snprintf(resp->path, sizeof(resp->path), "%s", req->path.ptr);
+    // keep the connection if the client wants it and it didnt reach the request limit
+    int keep = req->keep_alive && can_keep_alive;
 
-        stats_decrement_active(shared, sems);
+    // the file path (and the log line) would be cut
+    if (req->path.len >= sizeof(resp->path)) {
+        build_error_response(resp, 414, "URI Too Long", keep);
         return;
     }
-    
 
     //only need to have get and head so we check that
     int is_head = 0;
-    if (strcmp(req.method, "GET") == 0) {
+    if (strcmp(req->method.ptr, "GET") == 0) {
         is_head = 0;
-    } else if (strcmp(req.method, "HEAD") == 0) {
+    } else if (strcmp(req->method.ptr, "HEAD") == 0) {
         is_head = 1;
     } else {
-        send_custom_error_page(client_fd, 405, "Method Not Allowed", document_root, "error405.html", "405 Method Not Allowed\n", shared, sems);
+        // other methods may have a body we dont read, so close instead of reading it as the next request
+        build_error_response(resp, 405, "Method Not Allowed", 0);
+        return;
+    }
 
-        // Log method not allowed
-        log_request(sems->log_mutex, ip_str, req.method, req.path, 405, 0);
+    // counters and latency histograms for a scraper, straight from the shared stats (no file behind it)
+    if (strcmp(req->path.ptr, STATS_URL) == 0) {
+        server_stats_t* stats = malloc(sizeof(server_stats_t));
+        char* text = malloc(STATS_RENDER_MAX);
+        if (!stats || !text) {
+            free(stats);
+            free(text);
+            build_error_response(resp, 500, "Internal Server Error", keep);
+            return;
+        }
+        stats_snapshot(shared, stats);
+        size_t len = stats_render_prometheus(stats, text, STATS_RENDER_MAX);
+        free(stats);
+        http_response_set_header(resp, 200, "OK", "text/plain; version=0.0.4", len, keep);
+        resp->owned = text;
+        resp->body = text;
+        resp->body_len = is_head ? 0 : len;
+        resp->stats_bytes = len;
+        resp->log_bytes = len;
+        return;
+    }
 
-        stats_decrement_active(shared, sems);
+    // this worker's request phase timings (see trace.h)
+    if (strcmp(req->path.ptr, TRACE_URL) == 0) {
+        size_t len = 0;
+        char* text = TRACE_ON() ? trace_dump(&len) : strdup("# tracing is off (TRACE_REQUESTS=1 in the config)\n");
+        if (!text) {
+            build_error_response(resp, 500, "Internal Server Error", keep);
+            return;
+        }
+        if (!TRACE_ON()) len = strlen(text);
+        http_response_set_header(resp, 200, "OK", "text/plain", len, keep);
+        resp->owned = text;
+        resp->body = text;
+        resp->body_len = is_head ? 0 : len;
+        resp->stats_bytes = len;
+        resp->log_bytes = len;
         return;
     }
 
     // Cant permit directory 
-    if (strstr(req.path, "..")) {
-        send_custom_error_page(client_fd, 403, "Forbidden", document_root, "error403.html", "403 Forbidden\n", shared, sems);
-
-        log_request(sems->log_mutex, ip_str, req.method, req.path, 403, 0);
-
-        stats_decrement_active(shared, sems);
+    if (strstr(req->path.ptr, "..")) {
+        build_error_response(resp, 403, "Forbidden", keep);
         return;
     }
 
    
     // get the file path
     char file_path[1024];
-    // if a dir is requestred we put the index.html requested on test 11
-    if (strcmp(req.path, "/") == 0 || req.path[strlen(req.path)-1] == '/') { //so if a dir like / or /subdir/
-        snprintf(file_path, sizeof(file_path), "%s%sindex.html", document_root, req.path);
-    } else {
-        snprintf(file_path, sizeof(file_path), "%s/%s", document_root, req.path[0] == '/' ? req.path+1 : req.path);
-    }
-    pthread_mutex_lock(&print_mutex);
-    printf("[DEBUG] Full file path: %s\n", file_path);
-    pthread_mutex_unlock(&print_mutex);
+    worker_file_path(document_root, req->path.ptr, file_path, sizeof(file_path));
+    LOG_DEBUG("Full file path: %s", file_path);
 
-    
-    FILE* fp = fopen(file_path, "rb");
-    if (!fp) {
-        pthread_mutex_lock(&print_mutex);
-        printf("[DEBUG] File not found: %s\n", file_path);
-        pthread_mutex_unlock(&print_mutex);
-        send_custom_error_page(client_fd, 404, "Not Found", document_root, "error404.html", "404 Not Found\n", shared, sems);
+    // Determine MIME type using helper
+    const char* mime = get_mime_type(file_path);
 
-        // Log not found
-        log_request(sems->log_mutex, ip_str, req.method, req.path, 404, 0);
+    // look in the cache first, a hit is sent straight from the shared entry (no open and no copy).
+    // The generation is taken before, so a miss never caches bytes older than an invalidate
+    unsigned long generation = cache_generation(g_cache, file_path);
+    cache_entry_t* entry = cache_get(g_cache, file_path);
+    if (entry) {
+        TRACE_MARK(&resp->trace, TRACE_OPEN);
+        send_entry(resp, req, entry, mime, is_head, keep);
+        return;
+    }
 
-        stats_decrement_active(shared, sems);
+    // open fd, size and validators of the path, from the fd cache most of the time (no open/fstat)
+    open_file_t* file = fd_cache_open(file_path);
+    TRACE_MARK(&resp->trace, TRACE_OPEN);
+    if (!file) {
+        build_error_response(resp, 500, "Internal Server Error", keep);
+        return;
+    }
+    if (file->fd < 0) { // a directory without the / is not found either
+        LOG_DEBUG("File not found: %s", file_path);
+        fd_cache_release(file);
+        build_error_response(resp, 404, "Not Found", keep);
         return;
     }
 
     // Get file size for the stats and response
-    fseek(fp, 0, SEEK_END);
-    size_t sz = (size_t)ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    size_t sz = file->size;
+    const file_validators_t* validators = &file->validators;
 
     if (sz == 0) { //if its an empty file 500 error
-        pthread_mutex_lock(&print_mutex);
-        printf("[DEBUG] File is empty: %s\n", file_path);
-        pthread_mutex_unlock(&print_mutex);
-        send_custom_error_page(client_fd, 500, "Internal Server Error", document_root, "error500.html", "500 Internal Server Error\n", shared, sems);
+        LOG_DEBUG("File is empty: %s", file_path);
+        fd_cache_release(file);
+        build_error_response(resp, 500, "Internal Server Error", keep);
+        return;
+    }
 
-        log_request(sems->log_mutex, ip_str, req.method, req.path, 500, 0);
+    if ((sz >= g_sendfile_threshold || is_head) && wants_gzip(req, mime) &&
+        send_gz_file(resp, req, file_path, file, mime, is_head, keep)) {
+        fd_cache_release(file);
+        return;
+    }
 
-        fclose(fp);
-        stats_decrement_active(shared, sems);
+    if (http_not_modified(req, validators)) {
+        build_not_modified(resp, mime, sz, validators, keep);
+        fd_cache_release(file);
         return;
     }
 
-    char *contents = NULL;
-    if (!is_head) {
-        contents = malloc(sz);
-        if (!contents) {
-            pthread_mutex_lock(&print_mutex);
-            printf("[DEBUG] Out of memory reading file\n");
-            pthread_mutex_unlock(&print_mutex);
-            send_custom_error_page(client_fd, 500, "Internal Server Error", document_root, "error500.html", "500 Internal Server Error\n", shared, sems);
+    http_range_t ranges[HTTP_MAX_RANGES];
+    int nranges = wanted_ranges(req, sz, validators, ranges);
+    if (nranges == 0) {
+        fd_cache_release(file);
+        build_range_not_satisfiable(resp, sz, keep);
+        return;
+    }
+    // ranges are sent straight from the file, the rest of it is never read
+    if (nranges > 0) {
+        resp->file = file; // released when the response is freed
+        resp->file_fd = file->fd;
+        if (send_ranges(resp, ranges, nranges, mime, sz, validators, is_head, keep) == 0) return;
+    }
 
-            // Log out of memory/internal error
-            log_request(sems->log_mutex, ip_str, req.method, req.path, 500, 0);
+    // big files are never read into memory, the kernel copies them from the page cache to the socket
+    if (sz >= g_sendfile_threshold || is_head || nranges > 0) {
+        set_file_header(resp, mime, sz, validators, keep);
+        resp->file = file; // released when the response is freed
+        resp->file_fd = file->fd;
+        resp->body_len = is_head ? 0 : sz;
+        resp->stats_bytes = sz;
+        resp->log_bytes = sz;
+        return;
+    }
 
-            fclose(fp);
-            stats_decrement_active(shared, sems);
-            return;
-        }
-        //a error handling that we found im,portant is if  we dont read the entire file send 500 error
-        size_t got = fread(contents, 1, sz, fp);
-        if (got != sz) {
-            pthread_mutex_lock(&print_mutex);
-            printf("[DEBUG] fread failed: read %zu bytes, expected %zu\n", got, sz);
-            pthread_mutex_unlock(&print_mutex);
-            send_custom_error_page(client_fd, 500, "Internal Server Error", document_root, "error500.html", "500 Internal Server Error\n", shared, sems);
-
-            log_request(sems->log_mutex, ip_str, req.method, req.path, 500, 0);
-
-            free(contents);
-            fclose(fp);
-            stats_decrement_active(shared, sems);
-            return;
-        }
+    char* contents = malloc(sz);
+    if (!contents) {
+        LOG_DEBUG("Out of memory reading file");
+        fd_cache_release(file);
+        build_error_response(resp, 500, "Internal Server Error", keep);
+        return;
+    }
+    //a error handling that we found im,portant is if  we dont read the entire file send 500 error
+    // pread: the fd is shared with the other threads, its file position is never used
+    size_t got = 0;
+    while (got < sz) {
+        ssize_t n = pread(file->fd, contents + got, sz - got, (off_t)got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        got += (size_t)n;
+    }
+    if (got != sz) {
+        LOG_DEBUG("read failed: read %zu bytes, expected %zu", got, sz);
+        free(contents);
+        fd_cache_release(file);
+        build_error_response(resp, 500, "Internal Server Error", keep);
+        return;
     }
-    fclose(fp);
 
-    // Determine MIME type using helper
-    const char* mime = get_mime_type(file_path);
+    // hand the buffer to the cache (with its gzip variant, made once here if it is small enough to
+    // not hold up the loop, see GZIP_INLINE_MAX), if it takes it the next requests wont touch the disk
+    size_t gz_size = 0;
+    unsigned char* gz = sz <= GZIP_INLINE_MAX ? gzip_variant(mime, (unsigned char*)contents, sz, &gz_size) : NULL;
+    entry = cache_put(g_cache, file_path, (unsigned char*)contents, sz, validators, gz, gz_size, generation);
+    if (entry) {
+        fd_cache_release(file);
+        send_entry(resp, req, entry, mime, is_head, keep); // owned by the cache now
+        TRACE_MARK(&resp->trace, TRACE_READ);
+        return;
+    }
+    // not cached: plain only, compressing it again on every request would cost more than it saves
+    free(gz);
+    set_file_header(resp, mime, sz, validators, keep);
+    fd_cache_release(file);
+    resp->owned = contents;
+    resp->body = contents;
+    resp->body_len = sz;
+    resp->stats_bytes = sz;
+    resp->log_bytes = sz;
+    TRACE_MARK(&resp->trace, TRACE_READ);
+}
 
-    //now put it in the response so that the client gets it
-    if (is_head) {
-        send_http_response(client_fd, 200, "OK", mime, NULL, sz); // body=NULL (because its HEAD), length is still needed for Content-Length test 12
-        stats_record_response(shared, sems, 200, sz);
+// If c->buf holds a complete request header, cuts it out and builds its response in c->resp
+// (pipelined requests stay in the buffer). A header too big for the buffer gets a 400.
+// Returns 1 when c->resp is ready to be written, 0 if more bytes are needed
+int worker_next_response(conn_t* c) {
+    // only the bytes that came since the last call are scanned
+    int r = http_parser_run(&c->parser, c->buf, c->len);
+    if (r == HTTP_PARSE_AGAIN && c->len < CONN_BUF_SIZE - 1) return 0;
+    if (r != HTTP_PARSE_DONE) {
+        // malformed or doesnt fit in the buffer: we dont know where this request ends so the
+        // connection cant be reused
+        LOG_DEBUG("Bad request header (%zu bytes)", c->len);
+        c->resp.started_ns = stats_now_ns();
+        stats_increment_active(g_shared);
+        build_error_response(&c->resp, 400, "Bad Request", 0);
+        strcpy(c->resp.method, "-");
+        strcpy(c->resp.path, "-");
+        c->len = 0;
+        c->buf[0] = '\0';
+        http_parser_reset(&c->parser);
+        return 1;
+    }
+    TRACE_MARK(&c->resp.trace, TRACE_PARSE);
+
+    size_t req_len = c->parser.req.header_len;
+    c->resp.started_ns = stats_now_ns();
+    build_response(&c->parser.req, c->requests + 1 < g_keepalive_max, &c->resp, g_shared);
+    memmove(c->buf, c->buf + req_len, c->len - req_len + 1); // +1 moves the '\0' too
+    c->len -= req_len;
+    http_parser_reset(&c->parser);
+    c->requests++;
+    return 1;
+}
 
-        // Log HEAD we still log the size even if no body
-        log_request(sems->log_mutex, ip_str, req.method, req.path, 200, sz);
-    } else {
-        send_http_response(client_fd, 200, "OK", mime, contents, sz);
-        stats_record_response(shared, sems, 200, sz);
+// Called once c->resp was written (ok 1) or given up on (ok 0): stats, access log, frees it.
+// Returns 1 if the connection can be used for the next request, 0 if it must be closed
+int worker_finish_response(conn_t* c, int ok) {
+    http_response_t* resp = &c->resp;
+    size_t stats_bytes = resp->stats_bytes;
+    size_t log_bytes = resp->log_bytes;
+    if (!ok) {
+        // only count the body bytes that really went out
+        size_t body_sent = resp->sent > resp->header_len ? resp->sent - resp->header_len : 0;
+        LOG_DEBUG("send stopped after %zu of %zu body bytes", body_sent, resp->body_len);
+        if (resp->body_len > 0) {
+            if (stats_bytes > body_sent) stats_bytes = body_sent;
+            if (log_bytes > body_sent) log_bytes = body_sent;
+        }
+    }
+    uint64_t now = stats_now_ns();
+    uint64_t latency_us = now > resp->started_ns ? (now - resp->started_ns) / 1000 : 0;
+    stats_record_response(g_shared, resp->status, stats_bytes, latency_us);
+    TRACE_MARK(&resp->trace, TRACE_STATS);
+    log_request("127.0.0.1", resp->method, resp->path, resp->status, log_bytes);
+    TRACE_MARK(&resp->trace, TRACE_LOG);
+    stats_decrement_active(g_shared);
+    if (TRACE_ON()) trace_end(&resp->trace, resp->status, resp->path);
+
+    // a client that got a short body cant tell where a next response would start
+    int keep = ok && resp->keep_alive;
+    http_response_free(resp); // drops the cache reference, closes the file
+    return keep;
+}
 
-        // Log GET with body
-        log_request(sems->log_mutex, ip_str, req.method, req.path, 200, sz);
+// Reads what the client has ready into c->buf without waiting.
+// Returns 1 if bytes were read, 0 if there is nothing yet, -1 if the client closed or failed
+int worker_read_request(conn_t* c) {
+    if (TRACE_ON()) trace_begin(&c->resp.trace);
+    while (1) {
+        ssize_t rlen = recv(c->fd, c->buf + c->len, CONN_BUF_SIZE - 1 - c->len, MSG_DONTWAIT);
+        if (rlen > 0) {
+            c->len += (size_t)rlen;
+            c->buf[c->len] = '\0';
+            TRACE_MARK(&c->resp.trace, TRACE_RECV);
+            return 1;
+        }
+        if (rlen < 0 && errno == EINTR) continue;
+        if (rlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // idle between requests is not part of the next one
+            if (TRACE_ON() && c->len == 0) trace_reset(&c->resp.trace);
+            return 0;
+        }
 
-        free(contents);
+        // client closed (normal end of a keep-alive connection) or error
+        if (c->requests == 0) {
+            LOG_DEBUG("recv() failed: rlen=%zd, errno=%d", rlen, errno);
+
+            // logging recv error 400
+            log_request("127.0.0.1", "-", "-", 400, 0);
+        }
+        return -1;
     }
+}
 
-    stats_decrement_active(shared, sems);
-    pthread_mutex_lock(&print_mutex);
-    printf("[DEBUG] Response sent, connection fd closed\n");
-    pthread_mutex_unlock(&print_mutex);
+// Thread pool mode: reads and answers the requests of a connection for as long as the client has
+// them ready. Never waits for the client: when there is no complete request in the buffer and
+// nothing to read, it returns 1 and the caller parks the connection in the idle poller.
+// Returns 0 to close
+int handle_client(conn_t* c) {
+    while (1) {
+        if (!worker_next_response(c)) {
+            int r = worker_read_request(c);
+            if (r > 0) continue;
+            return r == 0; // nothing to read yet: wait for more in the poller
+        }
+        // the socket blocks, SO_SNDTIMEO stops a client that doesnt read from holding the thread
+        int ok = http_response_write(c->fd, &c->resp) == 1;
+        TRACE_MARK(&c->resp.trace, TRACE_SEND);
+        if (!worker_finish_response(c, ok)) return 0;
+    }
 }
 
-void run_worker_process(int listen_fd,
+void worker_pin_cpu(int cpu) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1) ncpus = 1;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu % ncpus, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) { // 0 = calling thread
+        LOG_ERROR("sched_setaffinity: %s", strerror(errno));
+    }
+}
+
+void run_worker_process(int* listen_fds, int nlisten, int worker_id,
                         shared_data_t* shared,
                         semaphores_t* sems,
-                        const server_config_t* config) {
+                        const server_config_t* config,
+                        file_cache_t* cache) {
 
     // Set global pointers for worker threads
     g_shared = shared;
     g_sems = sems;
+    stats_set_worker(worker_id);
+    g_cache = cache;
+    if (config->sendfile_threshold_kb > 0) g_sendfile_threshold = (size_t)config->sendfile_threshold_kb * 1024;
+    if (config->keepalive_max_requests > 0) g_keepalive_max = config->keepalive_max_requests;
+    if (config->timeout_seconds > 0) g_timeout = config->timeout_seconds;
+    http_set_keepalive(g_timeout, g_keepalive_max);
+
+    // a client that closes in the middle of a (big) download must not kill the whole worker
+    signal(SIGPIPE, SIG_IGN);
+
+    // before any other thread exists, they all inherit the signal mask it sets
+    if (logger_init(config->log_file, sems->log_mutex) != 0) {
+        LOG_ERROR("Couldnt start access logger: %s", strerror(errno));
+    }
+    trace_init(config->trace_requests);
 
     
-    strncpy(g_document_root, config->document_root, sizeof(g_document_root)-1);
-    // Create the file cache
-    size_t cache_bytes = 10 * 1024 * 1024;//default the 10MB if cant read from config
-    if (config->cache_size_mb > 0) cache_bytes = config->cache_size_mb * 1024 * 1024;
-    g_cache = cache_create(cache_bytes);
-    if (!g_cache) {
-        pthread_mutex_lock(&print_mutex);
-        perror("Couldnt create cache");
-        pthread_mutex_unlock(&print_mutex);
-        exit(EXIT_FAILURE);
+    snprintf(g_document_root, sizeof(g_document_root), "%s", config->document_root);
+    if (fd_cache_init(config->fd_cache_entries ? config->fd_cache_entries : DEFAULT_FD_CACHE_ENTRIES,
+                      config->fd_cache_ttl_seconds ? config->fd_cache_ttl_seconds : DEFAULT_FD_CACHE_TTL_SECONDS) != 0) {
+        LOG_ERROR("Couldnt create fd cache: %s", strerror(errno));
+    }
+    // a shared cache is reloaded by worker 0 alone, reading and compressing each file once
+    if (watcher_start(g_document_root, g_cache, g_sendfile_threshold, !g_cache->shm || worker_id == 0) != 0) {
+        LOG_WARN("Couldnt watch %s (%s), cached files stay as they are until restart or eviction (the fd cache still expires)", g_document_root, strerror(errno));
+    }
+    if (error_pages_init(g_document_root) != 0) {
+        LOG_ERROR("Couldnt load error pages: %s", strerror(errno));
     }
 
     // Create thread pool same thing have a default of 10 if it cant read it from config
     int nthreads = (config->threads_per_worker > 0) ? config->threads_per_worker : 10;
-    thread_pool_t* pool = create_thread_pool(nthreads);
+
+    // with cpu steering the kernel sends this worker the connections that arrived on its cpu, so
+    // run there too. With one socket per thread each event loop pins itself instead
+    int steering = config->reuseport_cpu && config->listen_mode != LISTEN_MODE_SHARED;
+    if (steering && nlisten == 1) worker_pin_cpu(worker_id);
+
+    // dispatch mode: listen_fds[0] is our channel from the master, it counts what it sends us
+    // in load[worker_id] and we count the connections back out as they close
+    int dispatched = config->listen_mode == LISTEN_MODE_DISPATCH;
+    if (dispatched) conn_set_inflight(&shared->load[worker_id].inflight);
+
+    // epoll mode: the threads run event loops instead of a pool fed by accept()
+    if (config->worker_mode == WORKER_MODE_EPOLL) {
+        run_event_loops(listen_fds, nlisten, nthreads, g_timeout,
+                        (steering && nlisten > 1) ? worker_id * nlisten : -1, dispatched);
+        return;
+    }
+    int listen_fd = listen_fds[0];
+
+    thread_pool_t* pool = create_thread_pool(nthreads, config);
 
     if (!pool) {
-        pthread_mutex_lock(&print_mutex);
-        perror("Couldnt create thread pool");
-        pthread_mutex_unlock(&print_mutex);
+        LOG_ERROR("Couldnt create thread pool: %s", strerror(errno));
         return;
     }
 
+    // idle keep-alive connections wait here instead of holding a pool thread
+    if (conn_init(pool, g_timeout) != 0) {
+        LOG_ERROR("Couldnt start keep-alive poller: %s", strerror(errno));
+        return;
+    }
+    // a client that stops reading cant hold a thread in send() forever
+    struct timeval send_timeout = { .tv_sec = g_timeout, .tv_usec = 0 };
+
     //accepting the fd loop its infinite to wait until it hears a connection
     struct sockaddr_in client_addr;
     socklen_t client_len = sizeof(client_addr);
     while (1) {
-        int client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
+        int client_fd;
+        if (dispatched) {
+            client_fd = recv_fd(listen_fd, 0);
+            if (client_fd < 0 && errno == EPIPE) return; // the master is gone, the worker ends with it
+        } else {
+            client_fd = accept(listen_fd, (struct sockaddr*)&client_addr, &client_len);
+        }
         if (client_fd < 0) {
             if (errno == EINTR) continue;
-            pthread_mutex_lock(&print_mutex);
-            perror("accept");
-            pthread_mutex_unlock(&print_mutex);
+            LOG_ERROR("%s: %s", dispatched ? "recv_fd" : "accept", strerror(errno));
             continue;
         }
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
         thread_addFd(pool, client_fd);
     }
 
@@ -5,11 +5,37 @@
 #include "shared_mem.h"
 #include "semaphores.h"
 #include "config.h"
+#include "cache.h"
+#include "conn.h"
 
-// Prefork model: workers accept on the shared listening socket inherited from parent.
-void run_worker_process(int listen_fd,
+// Prefork model: workers accept on the listening socket(s) inherited from parent, the shared one
+// (nlisten 1) or their own SO_REUSEPORT ones (one per worker or one per event loop thread).
+// worker_id picks the cpu with REUSEPORT_CPU_AFFINITY.
+// cache is created by the master before fork (per process copy, or the shared segment in CACHE_MODE=shared)
+void run_worker_process(int* listen_fds, int nlisten, int worker_id,
                         shared_data_t* shared,
                         semaphores_t* sems,
-                        const server_config_t* config);
+                        const server_config_t* config,
+                        file_cache_t* cache);
+
+// Request handling steps shared by the thread pool and the event loops (connection sockets are
+// never waited on here, the caller decides what to do when they would block)
+int worker_read_request(conn_t* c);
+int worker_next_response(conn_t* c);
+int worker_finish_response(conn_t* c, int ok);
+
+// Content-Type of a file from its extension
+const char* get_mime_type(const char* file_path);
+
+// File (and cache key) of a request path under document_root: repeated slashes squeezed,
+// "/dir/" -> "/dir/index.html"
+void worker_file_path(const char* document_root, const char* path, char* out, size_t size);
+
+// Header fields of the 200 responses for a cache entry (cache_set_render): the plain one, '\0',
+// then the gzip one if the entry has a gzip variant. No status line, Date or Connection
+size_t worker_render_headers(const cache_entry_t* entry, char* out, size_t max);
+
+// Pin the calling thread (and the threads it creates afterwards) to cpu % number of cpus
+void worker_pin_cpu(int cpu);
 
 #endif
@@ -0,0 +1,89 @@
+// Benchmark de contenção da cache: mede hits/s com 1, 2, 4 ... N threads
+// Uso: ./tests/bench_cache [max_threads] [hits_por_thread]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../src/cache.h"
+
+#define NUM_KEYS 4096
+#define ENTRY_SIZE 512
+
+static file_cache_t* cache;
+static char keys[NUM_KEYS][64];
+static long hits_per_thread;
+static int hot_only; // 1 = todas as threads pedem o mesmo ficheiro (pior caso)
+
+static void* run_reader(void* arg) {
+    unsigned long x = (unsigned long)arg * 2654435761UL + 1; // xorshift por thread
+    long misses = 0;
+    for (long i = 0; i < hits_per_thread; i++) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        const char* key = hot_only ? keys[0] : keys[x % NUM_KEYS];
+        cache_entry_t* e = cache_get(cache, key);
+        if (!e) { misses++; continue; }
+        cache_release(e);
+    }
+    return (void*)misses;
+}
+
+static double run_round(int nthreads) {
+    pthread_t threads[nthreads];
+    struct timespec start, end;
+    long misses = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, run_reader, (void*)(long)(i + 1));
+    }
+    for (int i = 0; i < nthreads; i++) {
+        void* ret;
+        pthread_join(threads[i], &ret);
+        misses += (long)ret;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (misses) fprintf(stderr, "Aviso: %ld misses (a cache devia ter tudo)\n", misses);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)nthreads * hits_per_thread / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+    hits_per_thread = argc > 2 ? atol(argv[2]) : 1000000;
+    if (max_threads <= 0 || hits_per_thread <= 0) {
+        fprintf(stderr, "Uso: %s [max_threads] [hits_por_thread]\n", argv[0]);
+        return 1;
+    }
+
+    // cache com espaço para tudo, só queremos medir hits
+    cache = cache_create((size_t)NUM_KEYS * ENTRY_SIZE * 4);
+    if (!cache) return 1;
+    for (int i = 0; i < NUM_KEYS; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "www/assets/file_%d.css", i);
+        unsigned char* data = malloc(ENTRY_SIZE);
+        memset(data, 'a' + i % 26, ENTRY_SIZE);
+        cache_entry_t* e = cache_put(cache, keys[i], data, ENTRY_SIZE, NULL, NULL, 0,
+                                   cache_generation(cache, keys[i]));
+        if (!e) {
+            fprintf(stderr, "cache_put falhou para %s\n", keys[i]);
+            return 1;
+        }
+        cache_release(e);
+    }
+
+    printf("--- Benchmark de Contenção da Cache (%d shards, %d ficheiros) ---\n", CACHE_SHARDS, NUM_KEYS);
+    printf("%8s %18s %18s\n", "Threads", "Hits/s (random)", "Hits/s (hot key)");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        hot_only = 0;
+        double uniform = run_round(t);
+        hot_only = 1;
+        double hot = run_round(t);
+        printf("%8d %18.0f %18.0f\n", t, uniform, hot);
+    }
+
+    cache_destroy(cache);
+    return 0;
+}
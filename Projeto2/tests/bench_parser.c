@@ -0,0 +1,168 @@
+// Benchmark do parser de pedidos: mede pedidos/s com o parser antigo (strstr do fim do cabeçalho
+// + cópia da primeira linha + sscanf) e com o src/http_parser.c (retomável, sem cópias) a procurar
+// os fins de linha byte a byte, com SSE2 e com AVX2
+// Uso: ./tests/bench_parser [pedidos_por_caso]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "../src/http_parser.h"
+
+#define BUF_SIZE 8192
+
+// ---- parser antigo (igual ao http.c antes do http_parser.c) ----
+typedef struct {
+    char method[16];
+    char path[512];
+    char version[16];
+    int keep_alive;
+} old_request_t;
+
+static int old_connection_header(const char* headers) {
+    const char* line = headers;
+    while ((line = strstr(line, "\r\n")) != NULL) {
+        line += 2;
+        if (line[0] == '\r' || line[0] == '\0') break;
+        if (strncasecmp(line, "Connection:", 11) == 0) {
+            const char* v = line + 11;
+            while (*v == ' ' || *v == '\t') v++;
+            if (strncasecmp(v, "close", 5) == 0) return 0;
+            if (strncasecmp(v, "keep-alive", 10) == 0) return 1;
+        }
+    }
+    return -1;
+}
+
+static int old_parse(const char* buffer, old_request_t* req) {
+    char* line_end = strstr(buffer, "\r\n");
+    if (!line_end) return -1;
+    char first_line[1024];
+    size_t len = line_end - buffer;
+    if (len >= sizeof(first_line)) return -1;
+    strncpy(first_line, buffer, len);
+    first_line[len] = '\0';
+    if (sscanf(first_line, "%15s %511s %15s", req->method, req->path, req->version) != 3) return -1;
+    int conn = old_connection_header(buffer);
+    if (conn >= 0) req->keep_alive = conn;
+    else req->keep_alive = (strcmp(req->version, "HTTP/1.1") == 0);
+    return 0;
+}
+
+// ---- pedidos ----
+static const char* curl_request =
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n";
+
+static const char* browser_request =
+    "GET /css/style.css?v=20240101 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: http://www.example.com:8080/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: pt-PT,pt;q=0.9,en-US;q=0.8,en;q=0.7\r\n"
+    "Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; consent=yes\r\n"
+    "If-None-Match: \"5f3a-1a2b3c4d\"\r\n"
+    "If-Modified-Since: Mon, 01 Jan 2024 12:00:00 GMT\r\n"
+    "\r\n";
+
+// ---- benchmark ----
+static char buf[BUF_SIZE];
+static volatile size_t sink; // para o compilador não tirar o parse
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// chunk = bytes por recv() simulado (0 = o pedido inteiro de uma vez). Como no servidor, o parser
+// antigo procura o fim do cabeçalho desde o início do buffer depois de cada leitura
+static double run_old(const char* request, size_t chunk, long iterations) {
+    size_t len = strlen(request);
+    if (chunk == 0) chunk = len;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        size_t have = 0;
+        while (1) {
+            size_t n = len - have < chunk ? len - have : chunk;
+            memcpy(buf + have, request + have, n);
+            have += n;
+            buf[have] = '\0';
+            if (strstr(buf, "\r\n\r\n")) break;
+        }
+        old_request_t req;
+        if (old_parse(buf, &req) != 0) abort();
+        sink += strlen(req.path) + (size_t)req.keep_alive;
+    }
+    return iterations / (now_seconds() - start);
+}
+
+static double run_new(const char* request, size_t chunk, long iterations, int simd) {
+    size_t len = strlen(request);
+    if (chunk == 0) chunk = len;
+    http_parser_set_simd(simd);
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        http_parser_t p;
+        http_parser_reset(&p);
+        size_t have = 0;
+        int r;
+        do {
+            size_t n = len - have < chunk ? len - have : chunk;
+            memcpy(buf + have, request + have, n);
+            have += n;
+            buf[have] = '\0';
+            r = http_parser_run(&p, buf, have);
+        } while (r == HTTP_PARSE_AGAIN && have < len);
+        if (r != HTTP_PARSE_DONE) abort();
+        sink += p.req.path.len + (size_t)p.req.keep_alive;
+    }
+    return iterations / (now_seconds() - start);
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+    if (iterations <= 0) {
+        fprintf(stderr, "Uso: %s [pedidos_por_caso]\n", argv[0]);
+        return 1;
+    }
+    const char* names[] = { "byte a byte", "SSE2", "AVX2" };
+    int levels = 0;
+    for (int l = 1; l <= 2; l++)
+        if (http_parser_set_simd(l) == l) levels = l;
+
+    struct {
+        const char* name;
+        const char* request;
+        size_t chunk;
+    } cases[] = {
+        { "curl", curl_request, 0 },
+        { "browser", browser_request, 0 },
+        { "browser/64B", browser_request, 64 },   // o cabeçalho chega em pedaços de 64 bytes
+    };
+
+    printf("--- Benchmark do Parser de Pedidos (pedidos/s, %ld por caso) ---\n", iterations);
+    printf("%12s %7s %14s", "Caso", "Bytes", "Antigo");
+    for (int l = 0; l <= levels; l++) printf(" %14s", names[l]);
+    printf("\n");
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        printf("%12s %7zu %14.0f", cases[c].name, strlen(cases[c].request),
+               run_old(cases[c].request, cases[c].chunk, iterations));
+        for (int l = 0; l <= levels; l++) printf(" %14.0f", run_new(cases[c].request, cases[c].chunk, iterations, l));
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Benchmark da fila de fds do thread pool: mede entregas/s (push -> pop) com a fila antiga
+// (mutex + cond + malloc por item) e com o anel lock-free do fd_queue.c
+// Uso: ./tests/bench_queue [max_consumidores] [fds_por_produtor]
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../src/fd_queue.h"
+
+// no servidor o anel tem lugar para todos os fds do processo (nunca enche), aqui o mesmo
+#define RING_CAPACITY 65536
+#define STOP_FD (-2) // um por consumidor no fim, para o fazer sair
+
+// ---- fila antiga (igual ao thread_pool.c antes do anel) ----
+typedef struct item {
+    int fd;
+    struct item* next;
+} item_t;
+
+static pthread_mutex_t old_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t old_cond = PTHREAD_COND_INITIALIZER;
+static item_t* old_head;
+static item_t* old_tail;
+
+static void old_push(int fd) {
+    item_t* it = malloc(sizeof(item_t));
+    it->fd = fd;
+    it->next = NULL;
+    pthread_mutex_lock(&old_mutex);
+    if (old_tail) old_tail->next = it;
+    else old_head = it;
+    old_tail = it;
+    pthread_cond_signal(&old_cond);
+    pthread_mutex_unlock(&old_mutex);
+}
+
+static int old_pop(void) {
+    pthread_mutex_lock(&old_mutex);
+    while (!old_head) pthread_cond_wait(&old_cond, &old_mutex);
+    item_t* it = old_head;
+    old_head = it->next;
+    if (!old_head) old_tail = NULL;
+    pthread_mutex_unlock(&old_mutex);
+    int fd = it->fd;
+    free(it);
+    return fd;
+}
+
+// ---- anel ----
+static fd_queue_t ring;
+
+static void ring_push(int fd) {
+    while (fd_queue_push(&ring, fd, 0) != 0) sched_yield(); // cheio: os consumidores estão atrasados
+}
+
+static int ring_pop(void) {
+    return fd_queue_pop(&ring, NULL);
+}
+
+// ---- benchmark ----
+static long fds_per_producer;
+static int use_ring;
+
+static void* run_producer(void* arg) {
+    long base = (long)arg * fds_per_producer;
+    for (long i = 0; i < fds_per_producer; i++) {
+        int fd = (int)((base + i) & 0xFFFFF); // só precisa de ser >= 0
+        if (use_ring) ring_push(fd);
+        else old_push(fd);
+    }
+    return NULL;
+}
+
+static void* run_consumer(void* arg) {
+    (void)arg;
+    long got = 0;
+    while (1) {
+        int fd = use_ring ? ring_pop() : old_pop();
+        if (fd == STOP_FD) break;
+        got++;
+    }
+    return (void*)got;
+}
+
+static double run_round(int nproducers, int nconsumers) {
+    pthread_t producers[nproducers], consumers[nconsumers];
+    struct timespec start, end;
+    long got = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < nconsumers; i++) pthread_create(&consumers[i], NULL, run_consumer, NULL);
+    for (int i = 0; i < nproducers; i++) pthread_create(&producers[i], NULL, run_producer, (void*)(long)i);
+    for (int i = 0; i < nproducers; i++) pthread_join(producers[i], NULL);
+    for (int i = 0; i < nconsumers; i++) {
+        if (use_ring) ring_push(STOP_FD);
+        else old_push(STOP_FD);
+    }
+    for (int i = 0; i < nconsumers; i++) {
+        void* ret;
+        pthread_join(consumers[i], &ret);
+        got += (long)ret;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long expected = (long)nproducers * fds_per_producer;
+    if (got != expected) fprintf(stderr, "Aviso: %ld fds entregues, esperados %ld\n", got, expected);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return (double)expected / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+    int max_consumers = argc > 1 ? atoi(argv[1]) : 16;
+    fds_per_producer = argc > 2 ? atol(argv[2]) : 1000000;
+    if (max_consumers <= 0 || fds_per_producer <= 0) {
+        fprintf(stderr, "Uso: %s [max_consumidores] [fds_por_produtor]\n", argv[0]);
+        return 1;
+    }
+    if (fd_queue_init(&ring, RING_CAPACITY) != 0) return 1;
+
+    // 1 produtor = o accept() de um worker, 2 = accept() + poller das conexões keep-alive
+    printf("--- Benchmark da Fila do Thread Pool (anel de %d fds) ---\n", RING_CAPACITY);
+    printf("%11s %14s %20s %20s\n", "Produtores", "Consumidores", "Fds/s (mutex+cond)", "Fds/s (anel)");
+    for (int p = 1; p <= 2; p++) {
+        for (int c = 1; c <= max_consumers; c *= 2) {
+            use_ring = 0;
+            double old = run_round(p, c);
+            use_ring = 1;
+            double lockfree = run_round(p, c);
+            printf("%11d %14d %20.0f %20.0f\n", p, c, old, lockfree);
+        }
+    }
+
+    fd_queue_destroy(&ring);
+    return 0;
+}
@@ -96,6 +96,8 @@ int main(int argc, char* argv[]) {
     printf("--- Teste de Concorrência de Sockets ---\n");
     printf("Porta: %d, Total Clientes: %d, Concorrência Máx: %d\n", port, num_clients, concurrency);
 
+    struct timespec start_ts, end_ts;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
     time_t start_time = time(NULL);
     int active_threads = 0;
     
@@ -125,12 +127,16 @@ int main(int argc, char* argv[]) {
     }
     
     time_t end_time = time(NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end_ts);
+    double elapsed = (end_ts.tv_sec - start_ts.tv_sec) + (end_ts.tv_nsec - start_ts.tv_nsec) / 1e9;
 
     printf("\n--- Resultados ---\n");
     printf("Total de Requisições Enviadas: %d\n", num_clients);
     printf("Conexões com Sucesso (200/503): %d\n", success_count);
     printf("Conexões com Falha/Erro (Timeout, etc.): %d\n", failure_count);
     printf("Tempo Total (s): %ld\n", end_time - start_time);
+    // throughput com resolucao de ns para comparar versoes (ex: com e sem cache)
+    printf("Throughput (req/s): %.1f\n", elapsed > 0 ? num_clients / elapsed : 0.0);
 
     free(threads);
     pthread_mutex_destroy(&count_mutex);
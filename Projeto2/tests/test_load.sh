@@ -16,7 +16,11 @@ NC='\033[0m'
 #Iniciar o servidor em background
 start_server() {
     echo -e "${YELLOW}>>> 1. Iniciando o servidor em background...${NC}"
-    $(SERVER_EXEC) $(CONFIG_FILE) > server_bg.log 2>&1 &
+    # o servidor lê sempre config.cfg da diretoria atual
+    [ -f config.cfg ] || cp ${CONFIG_FILE} config.cfg
+    # ficheiro de texto para o teste de gzip (criado antes do arranque para o preload também o ver)
+    seq 1 2000 > www/teste_gzip.txt
+    ${SERVER_EXEC} > server_bg.log 2>&1 &
     SERVER_PID=$!
     if [ -z "$(ps -p $SERVER_PID -o pid=)" ]; then
         echo -e "${RED}ERRO: Servidor não conseguiu iniciar.${NC}"
@@ -48,7 +52,7 @@ functional_tests() {
     fi
     
     #Forbidden (Teste 10)
-    STATUS=$(curl -s -o /dev/null -w "%{http_code}" ${SERVER_URL}/../Makefile)
+    STATUS=$(curl -s --path-as-is -o /dev/null -w "%{http_code}" ${SERVER_URL}/../Makefile)
     if [ "$STATUS" -eq 403 ]; then
         echo -e "${GREEN}[PASS] Directory Traversal -> 403 Forbidden${NC}"
     else
@@ -64,9 +68,96 @@ functional_tests() {
     fi
 }
 
+# compara o obtido com o esperado e escreve PASS/FAIL
+check() {
+    if [ "$2" == "$3" ]; then
+        echo -e "${GREEN}[PASS] $1 -> $2${NC}"
+    else
+        echo -e "${RED}[FAIL] $1 -> Esperado $2, Obtido $3${NC}"
+    fi
+}
+
+# envia os bytes dados numa ligação TCP crua (cada argumento é uma escrita, com 0.2s entre elas)
+# e devolve tudo o que o servidor respondeu até fechar
+raw_request() {
+    exec 3<>/dev/tcp/localhost/${PORT} || return
+    for part in "$@"; do
+        printf "$part" >&3
+        sleep 0.2
+    done
+    timeout 3 cat <&3
+    exec 3>&-
+}
+
+# Protocolo: pedidos partidos e em pipeline, keep-alive, 304, ranges, páginas de erro e gzip
+protocol_tests() {
+    echo -e "${YELLOW}>>> 3. Testes de Protocolo (Parser, Keep-Alive, Condicionais, Ranges, Erros, Gzip)${NC}"
+
+    # pedido partido a meio de um header: o parser tem de esperar pelo resto
+    STATUS=$(raw_request "GET /index.html HTTP/1.1\r\nHo" "st: localhost\r\nConnection: close\r\n\r\n" | head -1 | tr -d '\r')
+    check "Pedido Partido em 2 Escritas" "HTTP/1.1 200 OK" "$STATUS"
+
+    # dois pedidos na mesma escrita: as duas respostas vêm pela ordem, na mesma ligação
+    COUNT=$(raw_request "GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\nGET /style.css HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n" | grep -c "^HTTP/1.1 200 OK")
+    check "Pipelining (2 pedidos numa escrita)" "2" "$COUNT"
+
+    # keep-alive: o curl reutiliza a ligação do primeiro pedido no segundo
+    CONNECTS=$(curl -s -o /dev/null -o /dev/null -w "%{num_connects} " ${SERVER_URL}/index.html ${SERVER_URL}/style.css)
+    check "Keep-Alive (ligações abertas por pedido)" "1 0 " "$CONNECTS"
+
+    # 304 com o ETag e com a data devolvidos pelo próprio servidor
+    ETAG=$(curl -s -I ${SERVER_URL}/index.html | grep -i "^ETag:" | awk '{print $2}' | tr -d '\r')
+    LASTMOD=$(curl -s -I ${SERVER_URL}/index.html | grep -i "^Last-Modified:" | cut -d' ' -f2- | tr -d '\r')
+    STATUS=$(curl -s -o /dev/null -w "%{http_code}" -H "If-None-Match: ${ETAG}" ${SERVER_URL}/index.html)
+    check "If-None-Match igual -> 304" "304" "$STATUS"
+    STATUS=$(curl -s -o /dev/null -w "%{http_code}" -H "If-Modified-Since: ${LASTMOD}" ${SERVER_URL}/index.html)
+    check "If-Modified-Since igual -> 304" "304" "$STATUS"
+    STATUS=$(curl -s -o /dev/null -w "%{http_code}" -H 'If-None-Match: "outro"' ${SERVER_URL}/index.html)
+    check "If-None-Match diferente -> 200" "200" "$STATUS"
+
+    # ranges (index.html tem 166 bytes)
+    SIZE=$(stat -c %s www/index.html)
+    RESULT=$(curl -s -o /dev/null -w "%{http_code} %{size_download}" -r 0-9 ${SERVER_URL}/index.html)
+    check "Range 0-9 -> 206 com 10 bytes" "206 10" "$RESULT"
+    RANGE=$(curl -s -D - -o /dev/null -r 0-9 ${SERVER_URL}/index.html | grep -i "^Content-Range:" | cut -d' ' -f2- | tr -d '\r')
+    check "Content-Range do 206" "bytes 0-9/${SIZE}" "$RANGE"
+    CTYPE=$(curl -s -D - -o /dev/null -r 0-1,4-5 ${SERVER_URL}/index.html | grep -i "^Content-Type:" | awk '{print $2}' | tr -d '\r;')
+    check "Vários Ranges -> multipart" "multipart/byteranges" "$CTYPE"
+    RESULT=$(curl -s -D - -o /dev/null -r 1000-2000 ${SERVER_URL}/index.html | grep -i -e "^HTTP/" -e "^Content-Range:" | tr -d '\r' | tr '\n' ' ')
+    check "Range fora do ficheiro -> 416" "HTTP/1.1 416 Range Not Satisfiable Content-Range: bytes */${SIZE} " "$RESULT"
+
+    # páginas de erro vêm de www/errors, com o status e o Content-Length certos
+    for code in 404 405; do
+        if [ "$code" -eq 404 ]; then URL=${SERVER_URL}/nao_existe.html; METHOD=GET; else URL=${SERVER_URL}/; METHOD=DELETE; fi
+        RESULT=$(curl -s -X ${METHOD} -o /tmp/erro_body.$$ -w "%{http_code} %{size_download}" ${URL})
+        check "Página de Erro ${code}" "${code} $(stat -c %s www/errors/error${code}.html)" "$RESULT"
+        if cmp -s /tmp/erro_body.$$ www/errors/error${code}.html; then
+            echo -e "${GREEN}[PASS] Corpo do ${code} = www/errors/error${code}.html${NC}"
+        else
+            echo -e "${RED}[FAIL] Corpo do ${code} diferente de www/errors/error${code}.html${NC}"
+        fi
+    done
+    rm -f /tmp/erro_body.$$
+
+    # gzip: só com Accept-Encoding, com Vary, e descomprime para o ficheiro original
+    HEADERS=$(curl -s -D - -o /tmp/gzip_body.$$ -H "Accept-Encoding: gzip" ${SERVER_URL}/teste_gzip.txt | tr -d '\r')
+    check "Accept-Encoding: gzip -> Content-Encoding" "Content-Encoding: gzip" "$(echo "$HEADERS" | grep -i "^Content-Encoding:")"
+    check "Vary na resposta comprimida" "Vary: Accept-Encoding" "$(echo "$HEADERS" | grep -i "^Vary:")"
+    if gunzip -c /tmp/gzip_body.$$ 2>/dev/null | cmp -s - www/teste_gzip.txt; then
+        echo -e "${GREEN}[PASS] Corpo gzip descomprime para o ficheiro${NC}"
+    else
+        echo -e "${RED}[FAIL] Corpo gzip não descomprime para o ficheiro${NC}"
+    fi
+    ENCODING=$(curl -s -D - -o /dev/null ${SERVER_URL}/teste_gzip.txt | grep -i -c "^Content-Encoding:")
+    check "Sem Accept-Encoding -> sem Content-Encoding" "0" "$ENCODING"
+    ENCODING=$(curl -s -D - -o /dev/null -H "Accept-Encoding: gzip;q=0" ${SERVER_URL}/teste_gzip.txt | grep -i -c "^Content-Encoding:")
+    check "gzip;q=0 -> sem Content-Encoding" "0" "$ENCODING"
+    rm -f /tmp/gzip_body.$$ www/teste_gzip.txt
+}
+
 #Testes de carga
 load_tests() {
-    echo -e "${YELLOW}>>> 3. Teste de Carga (Apache Bench - ${NUM_REQUESTS} requests, ${CONCURRENCY} conc.) (Teste 13, 21)${NC}"
+    echo -e "${YELLOW}>>> 4. Teste de Carga (Apache Bench - ${NUM_REQUESTS} requests, ${CONCURRENCY} conc.) (Teste 13, 21)${NC}"
     
     AB_OUTPUT=$(ab -n ${NUM_REQUESTS} -c ${CONCURRENCY} ${SERVER_URL}/index.html 2>&1) #Apache Bench
     
@@ -83,7 +174,7 @@ load_tests() {
 
 # TEst do graceful shutdown e zombies
 shutdown_tests() {
-    echo -e "${YELLOW}>>> 4. Teste de Graceful Shutdown (Teste 23, 24)${NC}"
+    echo -e "${YELLOW}>>> 5. Teste de Graceful Shutdown (Teste 23, 24)${NC}"
     
     #SIGINT para simular Ctrl+C
     kill -SIGINT $SERVER_PID
@@ -110,5 +201,6 @@ if ! start_server; then
 fi
 
 functional_tests
+protocol_tests
 load_tests
 shutdown_tests
\ No newline at end of file